@@ -0,0 +1,896 @@
+/** Includes **/
+#include "memalloc.hpp"
+#include "pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/** memalloc-bench runs each workload against memalloc and the system
+ * malloc side by side, every run in a forked child so peak RSS is its own.
+ *
+ *   memalloc-bench [--ops N] [--threads N] [--decay-ms N] [workload...]
+ *   memalloc-bench --trace FILE
+ *
+ * Traces are recorded with MEMALLOC_TRACE=FILE LD_PRELOAD=libmemalloc.so. **/
+
+namespace {
+
+struct Allocator {
+  const char *name;
+  void *(*alloc)(size_t);
+  void (*free)(void *);
+  void *(*realloc)(void *, size_t);
+  void *(*calloc)(size_t, size_t);
+  void *(*alignedAlloc)(size_t, size_t);
+};
+
+const Allocator allocators[]{
+    {"memalloc", memalloc::alloc, memalloc::free, memalloc::realloc,
+     memalloc::calloc, memalloc::alignedAlloc},
+    {"system", ::malloc, ::free, ::realloc, ::calloc, ::aligned_alloc},
+};
+
+struct Options {
+  size_t ops{1000000};
+  size_t threads{std::max(1u, std::thread::hardware_concurrency())};
+  const char *trace{nullptr};
+  size_t decay_ms{200}; // memalloc's purge decay in the burst workload
+};
+
+/** Sent from the child running a workload back to the parent **/
+struct Result {
+  double seconds;
+  uint64_t ops;
+  uint64_t p50, p99, p999; // Per call latency in ns
+  uint64_t peak_rss;       // Bytes above the RSS at start
+  uint64_t peak_live;      // Bytes requested and not yet freed, at peak
+};
+
+uint64_t nowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t currentRss() {
+  FILE *statm{fopen("/proc/self/statm", "r")};
+  unsigned long pages{}, resident{};
+  if (statm != nullptr) {
+    if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+uint64_t peakRss() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return uint64_t(usage.ru_maxrss) * 1024;
+}
+
+/** Per thread latency samples and live byte accounting **/
+struct Recorder {
+  std::vector<uint32_t> samples;
+  int64_t live{};
+  int64_t peak_live{};
+
+  // Touched up front so sample storage does not show up as workload RSS
+  explicit Recorder(size_t capacity) : samples(capacity) { samples.clear(); }
+
+  template <typename F> auto time(F &&call) {
+    uint64_t start{nowNs()};
+    auto result{call()};
+    samples.push_back(static_cast<uint32_t>(nowNs() - start));
+    return result;
+  }
+
+  void timeFree(const Allocator &a, void *ptr) {
+    uint64_t start{nowNs()};
+    a.free(ptr);
+    samples.push_back(static_cast<uint32_t>(nowNs() - start));
+  }
+
+  void track(int64_t bytes) {
+    live += bytes;
+    peak_live = std::max(peak_live, live);
+  }
+};
+
+/** Live bytes when blocks are freed by another thread than the one that
+ * allocated them. Threads fold their changes in every SYNC_OPS calls, so
+ * the peak is exact within that many blocks per thread. **/
+struct SharedLive {
+  static constexpr size_t SYNC_OPS{64};
+
+  std::atomic<int64_t> live{};
+  std::atomic<int64_t> peak{};
+
+  void add(int64_t bytes) {
+    int64_t now{live.fetch_add(bytes, std::memory_order_relaxed) + bytes};
+    int64_t seen{peak.load(std::memory_order_relaxed)};
+    while (now > seen && !peak.compare_exchange_weak(
+                             seen, now, std::memory_order_relaxed)) {
+    }
+  }
+};
+
+/** Blocks handed between threads carry their requested size in their
+ * first word, whoever frees them reads it back **/
+void *tagged(void *ptr, size_t size) {
+  *static_cast<size_t *>(ptr) = size;
+  return ptr;
+}
+
+int64_t taggedSize(void *ptr) { return *static_cast<int64_t *>(ptr); }
+
+uint64_t percentile(std::vector<uint32_t> &samples, double p) {
+  if (samples.empty())
+    return 0;
+
+  size_t index{static_cast<size_t>(p * (samples.size() - 1))};
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+/** 90% small, 9% medium, 1% large, log-uniform inside each band **/
+size_t randomSize(std::mt19937_64 &rng) {
+  unsigned band{static_cast<unsigned>(rng() % 100)};
+  size_t low{band < 90 ? 8u : band < 99 ? 512u : 16384u};
+  size_t high{band < 90 ? 512u : band < 99 ? 16384u : 262144u};
+  double scale{std::uniform_real_distribution<double>{0, 1}(rng)};
+  return static_cast<size_t>(low * std::pow(double(high) / low, scale));
+}
+
+/** Workloads, each returns the number of allocator calls it timed **/
+
+uint64_t fixedChurn(const Allocator &a, const Options &opt, Recorder &rec) {
+  std::vector<void *> slots(4096, nullptr);
+  std::mt19937_64 rng{1};
+  for (size_t i{}; i < opt.ops; i++) {
+    void *&slot{slots[rng() % slots.size()]};
+    if (slot != nullptr) {
+      rec.timeFree(a, slot);
+      rec.track(-64);
+    }
+    slot = rec.time([&] { return a.alloc(64); });
+    rec.track(64);
+  }
+
+  for (void *ptr : slots) {
+    a.free(ptr);
+  }
+  return rec.samples.size();
+}
+
+uint64_t randomSizes(const Allocator &a, const Options &opt, Recorder &rec) {
+  std::vector<std::pair<void *, size_t>> slots(16384, {nullptr, 0});
+  std::mt19937_64 rng{2};
+  for (size_t i{}; i < opt.ops; i++) {
+    auto &slot{slots[rng() % slots.size()]};
+    if (slot.first != nullptr) {
+      rec.timeFree(a, slot.first);
+      rec.track(-int64_t(slot.second));
+    }
+    size_t size{randomSize(rng)};
+    slot = {rec.time([&] { return a.alloc(size); }), size};
+    static_cast<char *>(slot.first)[0] = 1; // Touch it like a real user
+    rec.track(size);
+  }
+
+  for (auto &slot : slots) {
+    a.free(slot.first);
+  }
+  return rec.samples.size();
+}
+
+/** One thread allocates, another frees what it is handed **/
+uint64_t producerConsumer(const Allocator &a, const Options &opt,
+                          Recorder &rec) {
+  constexpr size_t RING{4096};
+  std::vector<std::atomic<void *>> ring(RING);
+  Recorder consumer_rec{opt.ops};
+  SharedLive shared;
+
+  std::thread consumer{[&] {
+    for (size_t i{}; i < opt.ops; i++) {
+      std::atomic<void *> &cell{ring[i % RING]};
+      void *ptr{nullptr};
+      while ((ptr = cell.exchange(nullptr, std::memory_order_acquire)) ==
+             nullptr) {
+        std::this_thread::yield();
+      }
+      consumer_rec.track(-taggedSize(ptr));
+      consumer_rec.timeFree(a, ptr);
+      if (i % SharedLive::SYNC_OPS == 0 || i + 1 == opt.ops) {
+        shared.add(consumer_rec.live);
+        consumer_rec.live = 0;
+      }
+    }
+  }};
+
+  std::mt19937_64 rng{3};
+  for (size_t i{}; i < opt.ops; i++) {
+    size_t size{16 + rng() % 497};
+    void *ptr{tagged(rec.time([&] { return a.alloc(size); }), size)};
+    rec.track(size);
+    if (i % SharedLive::SYNC_OPS == 0 || i + 1 == opt.ops) {
+      shared.add(rec.live);
+      rec.live = 0;
+    }
+    std::atomic<void *> &cell{ring[i % RING]};
+    while (cell.load(std::memory_order_acquire) != nullptr) {
+      std::this_thread::yield();
+    }
+    cell.store(ptr, std::memory_order_release);
+  }
+  consumer.join();
+
+  rec.peak_live = shared.peak.load();
+  rec.samples.insert(rec.samples.end(), consumer_rec.samples.begin(),
+                     consumer_rec.samples.end());
+  return rec.samples.size();
+}
+
+/** Buffers grow by half their size up to 4 MiB, like a string builder **/
+uint64_t growingRealloc(const Allocator &a, const Options &opt,
+                        Recorder &rec) {
+  size_t rounds{std::max<size_t>(1, opt.ops / 256)};
+  for (size_t r{}; r < rounds; r++) {
+    void *ptr{nullptr};
+    for (size_t size{16}; size < (size_t{4} << 20); size += size / 2) {
+      ptr = rec.time([&] { return a.realloc(ptr, size); });
+      static_cast<char *>(ptr)[size - 1] = 1;
+      rec.peak_live = std::max<int64_t>(rec.peak_live, size);
+    }
+    rec.timeFree(a, ptr);
+  }
+  return rec.samples.size();
+}
+
+/** Threads churn locally and hand a quarter of their blocks to the next
+ * thread, ops are per thread so linear scaling keeps seconds flat **/
+uint64_t threadScaling(const Allocator &a, const Options &opt, Recorder &rec,
+                       size_t threads) {
+  std::vector<std::vector<std::atomic<void *>>> handoff(threads);
+  for (auto &slots : handoff) {
+    slots = std::vector<std::atomic<void *>>(1024);
+  }
+  std::vector<Recorder> recs;
+  for (size_t t{}; t < threads; t++) {
+    recs.emplace_back(opt.ops * 2);
+  }
+
+  SharedLive shared;
+
+  std::vector<std::thread> workers;
+  for (size_t t{}; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      Recorder &r{recs[t]};
+      std::vector<void *> slots(1024, nullptr);
+      std::mt19937_64 rng{t};
+      for (size_t i{}; i < opt.ops; i++) {
+        size_t size{16 + rng() % 241};
+        void *ptr{tagged(r.time([&] { return a.alloc(size); }), size)};
+        r.track(size);
+        if (rng() % 4 == 0) {
+          auto &cell{handoff[(t + 1) % threads][rng() % 1024]};
+          ptr = cell.exchange(ptr, std::memory_order_acq_rel);
+        } else {
+          std::swap(ptr, slots[rng() % slots.size()]);
+        }
+        if (ptr != nullptr) {
+          r.track(-taggedSize(ptr));
+          r.timeFree(a, ptr);
+        }
+        if (i % SharedLive::SYNC_OPS == 0 || i + 1 == opt.ops) {
+          shared.add(r.live);
+          r.live = 0;
+        }
+      }
+      for (void *ptr : slots) {
+        a.free(ptr);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (auto &slots : handoff) {
+    for (auto &cell : slots) {
+      a.free(cell.load());
+    }
+  }
+  for (auto &r : recs) {
+    rec.samples.insert(rec.samples.end(), r.samples.begin(), r.samples.end());
+  }
+  rec.peak_live = shared.peak.load();
+  return rec.samples.size();
+}
+
+/** Replayed in recorded order from a pre-decoded event array, so only the
+ * allocator calls are timed **/
+struct Event {
+  memalloc::trace::Op op;
+  uint32_t slot;
+  uint64_t size;
+  uint64_t alignment;
+};
+
+bool loadTrace(const char *path, std::vector<Event> &events, size_t &slots) {
+  FILE *file{fopen(path, "rb")};
+  if (file == nullptr)
+    return false;
+
+  std::vector<unsigned char> data;
+  unsigned char chunk[1 << 16];
+  size_t n{};
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+
+  const size_t header{sizeof(memalloc::trace::MAGIC) + 1};
+  if (data.size() < header ||
+      memcmp(data.data(), memalloc::trace::MAGIC, header - 1) != 0 ||
+      data[header - 1] != memalloc::trace::VERSION)
+    return false;
+
+  // Addresses only pair calls up, map each live one to a slot index
+  std::unordered_map<uint64_t, uint32_t> live;
+  std::vector<uint32_t> free_slots;
+  auto take{[&](uint64_t address) {
+    uint32_t slot{static_cast<uint32_t>(slots)};
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      slots++;
+    }
+    live[address] = slot;
+    return slot;
+  }};
+  auto release{[&](uint64_t address, uint32_t &slot) {
+    auto it{live.find(address)};
+    if (it == live.end())
+      return false; // Allocated before recording started
+    slot = it->second;
+    free_slots.push_back(slot);
+    live.erase(it);
+    return true;
+  }};
+
+  const unsigned char *in{data.data() + header};
+  const unsigned char *end{data.data() + data.size()};
+  while (in != end) {
+    auto op{static_cast<memalloc::trace::Op>(*in++)};
+    int count{memalloc::trace::argCount(op)};
+    if (count < 0)
+      return false;
+
+    uint64_t args[3]{};
+    for (int i{}; i < count; i++) {
+      if (!memalloc::trace::readVarint(in, end, args[i]))
+        return false;
+    }
+
+    Event event{op, 0, 0, 0};
+    switch (op) {
+    case memalloc::trace::Op::Malloc:
+    case memalloc::trace::Op::Calloc:
+      if (args[1] == 0)
+        continue;
+      event.size = args[0];
+      event.slot = take(args[1]);
+      break;
+    case memalloc::trace::Op::Aligned:
+      if (args[2] == 0)
+        continue;
+      event.alignment = args[0];
+      event.size = args[1];
+      event.slot = take(args[2]);
+      break;
+    case memalloc::trace::Op::Free:
+      if (!release(args[0], event.slot))
+        continue;
+      break;
+    case memalloc::trace::Op::Realloc: {
+      if (args[2] == 0)
+        continue;
+      event.size = args[1];
+      auto it{live.find(args[0])};
+      if (it == live.end()) {
+        event.op = memalloc::trace::Op::Malloc; // Fresh or foreign pointer
+        event.slot = take(args[2]);
+        break;
+      }
+      event.slot = it->second; // The block keeps its slot when it moves
+      live.erase(it);
+      live[args[2]] = event.slot;
+      break;
+    }
+    }
+    events.push_back(event);
+  }
+
+  return true;
+}
+
+uint64_t replay(const Allocator &a, const std::vector<Event> &events,
+                size_t slot_count, Recorder &rec) {
+  std::vector<std::pair<void *, uint64_t>> slots(slot_count, {nullptr, 0});
+  for (const Event &event : events) {
+    auto &slot{slots[event.slot]};
+    switch (event.op) {
+    case memalloc::trace::Op::Malloc:
+      slot.first = rec.time([&] { return a.alloc(event.size); });
+      break;
+    case memalloc::trace::Op::Calloc:
+      slot.first = rec.time([&] { return a.calloc(1, event.size); });
+      break;
+    case memalloc::trace::Op::Aligned:
+      slot.first = rec.time(
+          [&] { return a.alignedAlloc(event.alignment, event.size); });
+      break;
+    case memalloc::trace::Op::Realloc:
+      rec.track(-int64_t(slot.second));
+      slot.first = rec.time([&] { return a.realloc(slot.first, event.size); });
+      break;
+    case memalloc::trace::Op::Free:
+      rec.timeFree(a, slot.first);
+      rec.track(-int64_t(slot.second));
+      slot = {nullptr, 0};
+      continue;
+    }
+    slot.second = event.size;
+    rec.track(event.size);
+  }
+
+  for (auto &slot : slots) {
+    a.free(slot.first);
+  }
+  return rec.samples.size();
+}
+
+using Workload = uint64_t (*)(const Allocator &, const Options &, Recorder &);
+
+struct NamedWorkload {
+  const char *name;
+  Workload run;
+};
+
+const NamedWorkload workloads[]{
+    {"fixed", fixedChurn},
+    {"random", randomSizes},
+    {"prodcons", producerConsumer},
+    {"realloc", growingRealloc},
+};
+
+/** Fork, run body in the child and collect its result through a pipe **/
+template <typename F, typename R> bool isolated(F &&body, R &result) {
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+
+  pid_t pid{fork()};
+  if (pid == 0) {
+    close(fds[0]);
+    R r{body()};
+    ssize_t written{write(fds[1], &r, sizeof(r))};
+    _exit(written == sizeof(r) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok{read(fds[0], &result, sizeof(result)) == sizeof(result)};
+  close(fds[0]);
+  int status{};
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+template <typename F> Result measure(size_t capacity, F &&run) {
+  Recorder rec{capacity};
+  uint64_t base_rss{currentRss()};
+  uint64_t start{nowNs()};
+  uint64_t ops{run(rec)};
+  double seconds{(nowNs() - start) / 1e9};
+
+  Result result{seconds, ops, 0, 0, 0, 0, uint64_t(rec.peak_live)};
+  result.p50 = percentile(rec.samples, 0.50);
+  result.p99 = percentile(rec.samples, 0.99);
+  result.p999 = percentile(rec.samples, 0.999);
+  uint64_t peak{peakRss()};
+  result.peak_rss = peak > base_rss ? peak - base_rss : 0;
+  return result;
+}
+
+void printHeader() {
+  printf("%-12s %-9s %9s %7s %7s %8s %10s %6s\n", "workload", "allocator",
+         "Mops/s", "p50ns", "p99ns", "p999ns", "peakRSS", "frag");
+}
+
+/** Share of the peak RSS growth that was not holding live bytes **/
+void printResult(const char *workload, const char *allocator,
+                 const Result &r) {
+  double frag{r.peak_rss > r.peak_live
+                  ? 1.0 - double(r.peak_live) / double(r.peak_rss)
+                  : 0.0};
+  printf("%-12s %-9s %9.2f %7lu %7lu %8lu %8.1fMB %5.1f%%\n", workload,
+         allocator, r.ops / r.seconds / 1e6, r.p50, r.p99, r.p999,
+         r.peak_rss / 1048576.0, frag * 100);
+}
+
+/** Alloc/free latency against the number of free blocks in the heap,
+ * the free blocks are too small for the request so a list walk would
+ * visit every one of them. The probe is past the 256 byte thread cache
+ * limit and the fragments are flushed out of the cache, so the heap
+ * search is what gets timed. **/
+void freeListScaling(const Options &opt) {
+  printf("\n%-9s %9s %7s %7s %8s\n", "allocator", "free", "p50ns", "p99ns",
+         "p999ns");
+  for (const Allocator &a : allocators) {
+    for (size_t count{10}; count <= 1000000; count *= 10) {
+      Result result{};
+      bool ok{isolated(
+          [&] {
+            std::vector<void *> blocks(2 * count);
+            for (void *&ptr : blocks) {
+              ptr = a.alloc(48);
+            }
+            for (size_t i{}; i < blocks.size(); i += 2) {
+              a.free(blocks[i]); // Every other block, nothing coalesces
+            }
+            memalloc::flushThreadCache(); // No-op for the system malloc
+            size_t pairs{std::min<size_t>(opt.ops, 200000)};
+            return measure(2 * pairs, [&](Recorder &rec) {
+              for (size_t i{}; i < pairs; i++) {
+                void *ptr{rec.time([&] { return a.alloc(512); })};
+                rec.timeFree(a, ptr);
+              }
+              return rec.samples.size();
+            });
+          },
+          result)};
+      if (ok) {
+        printf("%-9s %9zu %7lu %7lu %8lu\n", a.name, count, result.p50,
+               result.p99, result.p999);
+      }
+    }
+  }
+}
+
+void threadScalingTable(const Options &opt) {
+  printf("\n%-9s %7s %9s %7s %7s %8s\n", "allocator", "threads", "Mops/s",
+         "p50ns", "p99ns", "p999ns");
+  for (const Allocator &a : allocators) {
+    for (size_t threads{1}; threads <= opt.threads; threads *= 2) {
+      Result result{};
+      size_t per_thread{std::max<size_t>(1, opt.ops / 4)};
+      Options scaled{opt};
+      scaled.ops = per_thread;
+      bool ok{isolated(
+          [&] {
+            return measure(0, [&](Recorder &rec) {
+              return threadScaling(a, scaled, rec, threads);
+            });
+          },
+          result)};
+      if (ok) {
+        printf("%-9s %7zu %9.2f %7lu %7lu %8lu\n", a.name, threads,
+               result.ops / result.seconds / 1e6, result.p50, result.p99,
+               result.p999);
+      }
+    }
+  }
+}
+
+/** 48 byte node churn through the general allocators and a SlabPool **/
+template <typename Alloc, typename Free>
+uint64_t nodeChurn(const Options &opt, Recorder &rec, Alloc &&alloc,
+                   Free &&free) {
+  std::vector<void *> slots(4096, nullptr);
+  std::mt19937_64 rng{3};
+  for (size_t i{}; i < opt.ops; i++) {
+    void *&slot{slots[rng() % slots.size()]};
+    if (slot != nullptr) {
+      rec.time([&] {
+        free(slot);
+        return 0;
+      });
+    }
+    slot = rec.time(alloc);
+  }
+
+  for (void *ptr : slots) {
+    if (ptr != nullptr) {
+      free(ptr);
+    }
+  }
+  return rec.samples.size();
+}
+
+/** Insert and erase in a hash map whose nodes come from Alloc **/
+template <typename Alloc>
+uint64_t mapChurn(const Options &opt, Recorder &rec, const Alloc &alloc) {
+  std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>,
+                     std::equal_to<uint64_t>, Alloc>
+      map{4096, std::hash<uint64_t>{}, std::equal_to<uint64_t>{}, alloc};
+  std::mt19937_64 rng{4};
+  for (size_t i{}; i < opt.ops; i++) {
+    uint64_t key{rng() % 4096};
+    rec.time([&] { return map.erase(key) != 0 || map.emplace(key, i).second; });
+  }
+  return rec.samples.size();
+}
+
+void poolTable(const Options &opt) {
+  printf("\n%-12s %9s %7s %7s %8s\n", "nodes", "Mops/s", "p50ns", "p99ns",
+         "p999ns");
+  auto row{[&](const char *name, auto &&run) {
+    Result result{};
+    if (isolated([&] { return measure(2 * opt.ops, run); }, result)) {
+      printf("%-12s %9.2f %7lu %7lu %8lu\n", name,
+             result.ops / result.seconds / 1e6, result.p50, result.p99,
+             result.p999);
+    }
+  }};
+
+  row("memalloc", [&](Recorder &rec) {
+    return nodeChurn(
+        opt, rec, [] { return memalloc::alloc(48); },
+        [](void *ptr) { memalloc::free(ptr); });
+  });
+  row("system", [&](Recorder &rec) {
+    return nodeChurn(
+        opt, rec, [] { return ::malloc(48); }, [](void *ptr) { ::free(ptr); });
+  });
+  row("pool", [&](Recorder &rec) {
+    memalloc::SlabPool slabs{48};
+    return nodeChurn(
+        opt, rec, [&] { return slabs.allocate(); },
+        [&](void *ptr) { slabs.deallocate(ptr); });
+  });
+  row("map/std", [&](Recorder &rec) {
+    return mapChurn(opt, rec, std::allocator<std::pair<const uint64_t,
+                                                       uint64_t>>{});
+  });
+  row("map/pool", [&](Recorder &rec) {
+    memalloc::PoolResource resource;
+    return mapChurn(
+        opt, rec,
+        memalloc::PoolAllocator<std::pair<const uint64_t, uint64_t>>{resource});
+  });
+}
+
+/** RSS at each phase of the burst workload and churn latency around it **/
+struct BurstResult {
+  uint64_t base_rss, burst_rss, freed_rss, decayed_rss;
+  uint64_t p50, p99, after_p50, after_p99;
+  uint64_t page_p50, page_p99, page_after_p50, page_after_p99;
+};
+
+/** Mixed sizes up to 2 KiB so frees reach the heap past the thread cache **/
+void steadyChurn(const Allocator &a, std::vector<void *> &slots,
+                 std::mt19937_64 &rng, size_t ops, Recorder *rec) {
+  for (size_t i{}; i < ops; i++) {
+    void *&slot{slots[rng() % slots.size()]};
+    size_t size{size_t{16} << (rng() % 8)};
+    if (rec != nullptr) {
+      rec->timeFree(a, slot);
+      slot = rec->time([&] { return a.alloc(size); });
+    } else {
+      a.free(slot);
+      slot = a.alloc(size);
+    }
+  }
+}
+
+/** Alloc, touch and free of 4 to 64 KiB blocks, timed as a whole so page
+ * faults count. After the decay these land next to purged free blocks. **/
+void pageChurn(const Allocator &a, size_t ops, Recorder &rec) {
+  for (size_t i{}; i < ops; i++) {
+    size_t size{size_t{4096} << (i % 5)};
+    rec.time([&] {
+      void *ptr{a.alloc(size)};
+      std::memset(ptr, 1, size);
+      a.free(ptr);
+      return 0;
+    });
+  }
+}
+
+/** Churn, a burst that is freed with a few survivors pinning the heap,
+ * then churn for a few decay periods. RSS should fall back after the
+ * burst while the churn latency, small and page sized, stays where it
+ * was. **/
+void burstTable(const Options &opt) {
+  printf("\n%-9s %9s %9s %9s %9s %7s %7s %9s %9s\n", "allocator", "baseRSS",
+         "burstRSS", "freedRSS", "decayRSS", "p50ns", "p99ns", "p50ns'",
+         "p99ns'");
+  BurstResult results[std::size(allocators)]{};
+  bool done[std::size(allocators)]{};
+  for (size_t i{}; i < std::size(allocators); i++) {
+    const Allocator &a{allocators[i]};
+    BurstResult &result{results[i]};
+    done[i] = isolated(
+        [&] {
+          memalloc::setDecayMs(opt.decay_ms);
+          size_t ops{std::max<size_t>(1, opt.ops / 4)};
+          size_t pages{std::max<size_t>(1, opt.ops / 64)};
+          Recorder before{2 * ops}, after{2 * ops};
+          Recorder pages_before{pages}, pages_after{pages};
+          std::vector<void *> slots(1024, nullptr);
+          std::vector<void *> burst(8192);
+          std::mt19937_64 rng{5};
+
+          BurstResult r{};
+          steadyChurn(a, slots, rng, ops, &before);
+          pageChurn(a, pages, pages_before);
+          r.base_rss = currentRss();
+
+          for (void *&ptr : burst) { // 128 MiB
+            ptr = a.alloc(16 * 1024);
+            std::memset(ptr, 1, 16 * 1024);
+          }
+          r.burst_rss = currentRss();
+          std::shuffle(burst.begin(), burst.end(), rng);
+          for (size_t i{64}; i < burst.size(); i++) {
+            a.free(burst[i]);
+          }
+          r.freed_rss = currentRss();
+
+          uint64_t until{nowNs() + 4 * opt.decay_ms * 1000000};
+          while (nowNs() < until) {
+            steadyChurn(a, slots, rng, 1000, nullptr);
+            usleep(10000);
+          }
+          r.decayed_rss = currentRss();
+          steadyChurn(a, slots, rng, ops, &after);
+          pageChurn(a, pages, pages_after);
+
+          r.p50 = percentile(before.samples, 0.50);
+          r.p99 = percentile(before.samples, 0.99);
+          r.after_p50 = percentile(after.samples, 0.50);
+          r.after_p99 = percentile(after.samples, 0.99);
+          r.page_p50 = percentile(pages_before.samples, 0.50);
+          r.page_p99 = percentile(pages_before.samples, 0.99);
+          r.page_after_p50 = percentile(pages_after.samples, 0.50);
+          r.page_after_p99 = percentile(pages_after.samples, 0.99);
+          return r;
+        },
+        result);
+    if (done[i]) {
+      printf("%-9s %7.1fMB %7.1fMB %7.1fMB %7.1fMB %7lu %7lu %9lu %9lu\n",
+             a.name, result.base_rss / 1048576.0,
+             result.burst_rss / 1048576.0, result.freed_rss / 1048576.0,
+             result.decayed_rss / 1048576.0, result.p50, result.p99,
+             result.after_p50, result.after_p99);
+    }
+  }
+
+  // Page sized churn, before the burst and next to what the decay purged
+  printf("\n%-9s %9s %9s %9s %9s\n", "allocator", "pageP50", "pageP99",
+         "pageP50'", "pageP99'");
+  for (size_t i{}; i < std::size(allocators); i++) {
+    if (done[i]) {
+      const BurstResult &result{results[i]};
+      printf("%-9s %9lu %9lu %9lu %9lu\n", allocators[i].name,
+             result.page_p50, result.page_p99, result.page_after_p50,
+             result.page_after_p99);
+    }
+  }
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: memalloc-bench [--ops N] [--threads N] [--decay-ms N] "
+          "[workload...]\n"
+          "       memalloc-bench --trace FILE\n"
+          "workloads: fixed random prodcons realloc freelist threads pool "
+          "burst\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opt;
+  std::vector<std::string> selected;
+  for (int i{1}; i < argc; i++) {
+    std::string arg{argv[i]};
+    if (arg == "--ops" && i + 1 < argc) {
+      opt.ops = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      opt.threads = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--decay-ms" && i + 1 < argc) {
+      opt.decay_ms = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--trace" && i + 1 < argc) {
+      opt.trace = argv[++i];
+    } else if (arg[0] == '-') {
+      usage();
+      return 1;
+    } else {
+      selected.push_back(arg);
+    }
+  }
+  auto wanted{[&](const char *name) {
+    return selected.empty() ||
+           std::find(selected.begin(), selected.end(), name) != selected.end();
+  }};
+
+  if (opt.trace != nullptr) {
+    std::vector<Event> events;
+    size_t slots{};
+    if (!loadTrace(opt.trace, events, slots)) {
+      fprintf(stderr, "memalloc-bench: cannot read trace %s\n", opt.trace);
+      return 1;
+    }
+
+    printHeader();
+    for (const Allocator &a : allocators) {
+      Result result{};
+      if (isolated(
+              [&] {
+                return measure(events.size(), [&](Recorder &rec) {
+                  return replay(a, events, slots, rec);
+                });
+              },
+              result)) {
+        printResult("replay", a.name, result);
+      }
+    }
+    return 0;
+  }
+
+  printHeader();
+  for (const NamedWorkload &workload : workloads) {
+    if (!wanted(workload.name))
+      continue;
+
+    for (const Allocator &a : allocators) {
+      Result result{};
+      if (isolated(
+              [&] {
+                return measure(2 * opt.ops, [&](Recorder &rec) {
+                  return workload.run(a, opt, rec);
+                });
+              },
+              result)) {
+        printResult(workload.name, a.name, result);
+      }
+    }
+  }
+
+  if (wanted("freelist")) {
+    freeListScaling(opt);
+  }
+  if (wanted("threads")) {
+    threadScalingTable(opt);
+  }
+  if (wanted("pool")) {
+    poolTable(opt);
+  }
+  if (wanted("burst")) {
+    burstTable(opt);
+  }
+
+  return 0;
+}
@@ -0,0 +1,173 @@
+/** Includes **/
+#include "arena.hpp"
+#include "memalloc.hpp"
+
+#include <new>
+#include <utility>
+
+namespace memalloc {
+
+/** Header at the start of each chunk, size counts the header too **/
+struct ArenaChunk {
+  ArenaChunk *prev; // Older chunk in an arena, next one in a cache
+  size_t size;
+};
+
+static_assert(sizeof(ArenaChunk) % alignof(std::max_align_t) == 0,
+              "Chunk payloads must stay aligned");
+
+namespace {
+
+/** Chunks are heap or mmap'd blocks, whatever alloc picks for their size **/
+ArenaChunk *newChunk(size_t size) {
+  ArenaChunk *chunk{static_cast<ArenaChunk *>(memalloc::alloc(size))};
+  if (chunk == nullptr)
+    return nullptr;
+
+  chunk->prev = nullptr;
+  chunk->size = usableSize(chunk);
+  return chunk;
+}
+
+char *chunkBegin(ArenaChunk *chunk) {
+  return reinterpret_cast<char *>(chunk + 1);
+}
+
+char *chunkEnd(ArenaChunk *chunk) {
+  return reinterpret_cast<char *>(chunk) + chunk->size;
+}
+
+} // namespace
+
+ChunkCache::~ChunkCache() {
+  while (chunks != nullptr) {
+    ArenaChunk *next{chunks->prev};
+    memalloc::free(chunks);
+    chunks = next;
+  }
+}
+
+/** First fit, a cache only ever holds a handful of chunks **/
+ArenaChunk *ChunkCache::acquire(size_t size) {
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    for (ArenaChunk **link{&chunks}; *link != nullptr;
+         link = &(*link)->prev) {
+      ArenaChunk *chunk{*link};
+      if (chunk->size >= size) {
+        *link = chunk->prev;
+        cached -= chunk->size;
+        return chunk;
+      }
+    }
+  }
+
+  return newChunk(size);
+}
+
+/** Chunks past max_bytes go back to the allocator **/
+void ChunkCache::release(ArenaChunk *chunk) {
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (cached + chunk->size <= max_bytes) {
+      chunk->prev = chunks;
+      chunks = chunk;
+      cached += chunk->size;
+      return;
+    }
+  }
+
+  memalloc::free(chunk);
+}
+
+size_t ChunkCache::cachedBytes() {
+  std::lock_guard<std::mutex> lock{mutex};
+  return cached;
+}
+
+Arena::~Arena() {
+  rewind({nullptr, nullptr});
+  if (spare != nullptr) {
+    release(spare);
+  }
+}
+
+void Arena::release(ArenaChunk *chunk) {
+  if (cache != nullptr) {
+    cache->release(chunk);
+  } else {
+    memalloc::free(chunk);
+  }
+}
+
+/** Chunks double up to MAX_CHUNK_SIZE, or fit the request if it is larger **/
+void *Arena::allocSlow(size_t size, size_t alignment) {
+  size_t needed{};
+  if (__builtin_add_overflow(sizeof(ArenaChunk) + alignment, size, &needed))
+    return nullptr;
+
+  ArenaChunk *chunk{nullptr};
+  if (spare != nullptr && spare->size >= needed) {
+    chunk = spare;
+    spare = nullptr;
+  } else {
+    size_t chunk_size{next_size > needed ? next_size : needed};
+    chunk = cache != nullptr ? cache->acquire(chunk_size)
+                             : newChunk(chunk_size);
+    if (chunk == nullptr)
+      return nullptr;
+
+    next_size = next_size < MAX_CHUNK_SIZE / 2 ? next_size * 2 : MAX_CHUNK_SIZE;
+  }
+
+  chunk->prev = current;
+  current = chunk;
+  ptr = chunkBegin(chunk);
+  end = chunkEnd(chunk);
+
+  return alloc(size, alignment);
+}
+
+void Arena::rewind(Mark mark) {
+  while (current != mark.chunk) {
+    ArenaChunk *chunk{current};
+    current = chunk->prev;
+    if (spare == nullptr || spare->size < chunk->size) {
+      std::swap(spare, chunk);
+    }
+    if (chunk != nullptr) {
+      release(chunk);
+    }
+  }
+
+  ptr = mark.ptr;
+  end = current != nullptr ? chunkEnd(current) : nullptr;
+}
+
+size_t Arena::chunkCount() const {
+  size_t count{};
+  for (ArenaChunk *chunk{current}; chunk != nullptr; chunk = chunk->prev) {
+    count++;
+  }
+
+  return count;
+}
+
+size_t Arena::capacity() const {
+  size_t bytes{};
+  for (ArenaChunk *chunk{current}; chunk != nullptr; chunk = chunk->prev) {
+    bytes += chunk->size;
+  }
+
+  return bytes;
+}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment) {
+  void *result{alloc(bytes, alignment)};
+  if (result == nullptr)
+    throw std::bad_alloc{};
+
+  return result;
+}
+
+} // namespace memalloc
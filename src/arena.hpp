@@ -0,0 +1,119 @@
+#pragma once
+
+/** Includes **/
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+
+namespace memalloc {
+
+struct ArenaChunk;
+
+/** Keeps chunks released by arenas so the next arena reuses them instead
+ * of going back to the allocator, and to mmap for large chunks. Shared
+ * between threads, the lock is only taken per chunk. **/
+class ChunkCache {
+public:
+  explicit ChunkCache(size_t max_bytes) : max_bytes{max_bytes} {}
+  ~ChunkCache();
+
+  ChunkCache(const ChunkCache &) = delete;
+  ChunkCache &operator=(const ChunkCache &) = delete;
+
+  /** A cached chunk of at least size bytes, else a new one **/
+  ArenaChunk *acquire(size_t size);
+  void release(ArenaChunk *chunk);
+
+  size_t cachedBytes();
+
+private:
+  std::mutex mutex;
+  ArenaChunk *chunks{nullptr};
+  size_t cached{};
+  size_t max_bytes;
+};
+
+/** Monotonic region allocator. Allocation bumps a pointer through chunks
+ * that double in size, free is a no-op and memory comes back all at once
+ * on rewind, reset or destruction, in O(chunks). Not thread safe. **/
+class Arena final : public std::pmr::memory_resource {
+public:
+  static constexpr size_t DEFAULT_CHUNK_SIZE{16 * 1024};
+  static constexpr size_t MAX_CHUNK_SIZE{64 * 1024 * 1024};
+
+  /** Chunks come from and return to cache when one is given **/
+  explicit Arena(size_t chunk_size = DEFAULT_CHUNK_SIZE,
+                 ChunkCache *cache = nullptr)
+      : next_size{chunk_size}, cache{cache} {}
+  ~Arena() override;
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /** nullptr when no chunk can be obtained, alignment is a power of two **/
+  void *alloc(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    uintptr_t aligned{(reinterpret_cast<uintptr_t>(ptr) + alignment - 1) &
+                      ~(alignment - 1)};
+    uintptr_t limit{reinterpret_cast<uintptr_t>(end)};
+    if (ptr == nullptr || aligned > limit || size > limit - aligned)
+      return allocSlow(size, alignment);
+
+    ptr = reinterpret_cast<char *>(aligned + size);
+    return reinterpret_cast<void *>(aligned);
+  }
+
+  void free(void *) {}
+
+  /** Position to rewind to, marks nest like a stack **/
+  struct Mark {
+    ArenaChunk *chunk;
+    char *ptr;
+  };
+
+  Mark save() const { return {current, ptr}; }
+
+  /** Chunks taken after the mark are released, the largest of them is
+   * kept as a spare so a scope in a loop does not churn chunks **/
+  void rewind(Mark mark);
+
+  /** Drop everything, the largest chunk stays as the spare **/
+  void reset() { rewind({nullptr, nullptr}); }
+
+  size_t chunkCount() const;
+  size_t capacity() const;
+
+  /** Rewinds when it goes out of scope **/
+  class Scope {
+  public:
+    explicit Scope(Arena &arena) : arena{arena}, mark{arena.save()} {}
+    ~Scope() { arena.rewind(mark); }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    Arena &arena;
+    Mark mark;
+  };
+
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  void *allocSlow(size_t size, size_t alignment);
+  void release(ArenaChunk *chunk);
+
+  ArenaChunk *current{nullptr}; // Newest chunk, linked to the older ones
+  ArenaChunk *spare{nullptr};   // Released by the last rewind
+  char *ptr{nullptr};
+  char *end{nullptr};
+  size_t next_size;
+  ChunkCache *cache;
+};
+
+} // namespace memalloc
@@ -1,229 +1,392 @@
 /** Includes **/
-#include <algorithm>
+#include "arena.hpp"
+#include "memalloc.hpp"
+#include "pool.hpp"
+
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <memory_resource>
+#include <string>
 #include <sys/mman.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
-/** Get size of a word in machine **/
-using word_t = intptr_t;
-
-constexpr size_t MAX_SIZE{4096};         // Define max size of the heap
-constexpr size_t M_MMAP_THRESHOLD{1024}; // min size to allocate using mmap
-
-struct Block {
-  size_t size;
-  bool inuse;
-
-  Block *prev{nullptr};
-  Block *next{nullptr};
-};
+int main() {
+  using memalloc::alloc;
+  using memalloc::Block;
+  using memalloc::blocksAvailable;
+  using memalloc::getHeader;
+
+  void *p1{alloc(115)};
+  Block *b1{getHeader(p1)}; // [128, 1] -> [rest, 0]
+  assert(b1->size == 128);
+  assert(b1->inuse);
+  assert(reinterpret_cast<uintptr_t>(p1) % alignof(std::max_align_t) == 0);
+  assert(blocksAvailable() == 2);
+  memalloc::free(p1); // Cached by this thread
+  assert(b1->inuse);
+  memalloc::flushThreadCache(); // [heap, 0]
+  assert(!b1->inuse);
+  assert(blocksAvailable() == 1);
+  [[maybe_unused]] const size_t heap{b1->size};
 
-static Block *head{nullptr};      // Heap will be implemented as a linked list
-std::vector<Block *> free_list{}; // Free list
+  void *p2{alloc(8)};
+  [[maybe_unused]] Block *b2{getHeader(p2)}; // [16, 1] -> [rest, 0]
+  assert(b2->size == 16);
+  assert(b1 == b2);
 
-size_t memorySize() {
-  size_t total{};
-  Block *curr{head};
+  void *p3{alloc(64)};
+  assert(getHeader(p3) == memalloc::nextBlock(b2)); // Split from the rest
+  assert(blocksAvailable() == 3);
+  memalloc::free(p3);
+  memalloc::free(p2);
+  memalloc::flushThreadCache(); // [heap, 0]
+  assert(b2->size == heap);
+  assert(blocksAvailable() == 1);
 
-  while (curr != nullptr) {
-    total += curr->size;
-    curr = curr->next;
+  void *g1{alloc(256)};
+  [[maybe_unused]] void *g2{alloc(16)}; // Keeps g1 and g3 apart
+  void *g3{alloc(64)};
+  [[maybe_unused]] void *g4{alloc(16)};
+  memalloc::free(g1);
+  memalloc::free(g3);
+  memalloc::flushThreadCache();
+  // Good-fit picks the smallest free block
+  [[maybe_unused]] void *g5{alloc(48)};
+  assert(g5 == g3);
+  assert(g2 != nullptr && g4 != nullptr);
+
+  std::atomic<void *> shared{nullptr};
+  std::atomic<bool> freed{false};
+  std::thread producer{[&] {
+    void *p{alloc(32)};
+    shared.store(p);
+    while (!freed.load()) {
+      std::this_thread::yield();
+    }
+    void *again{alloc(32)};
+    assert(again == p); // Drained from the remote free queue
+    memalloc::free(again);
+  }};
+  while (shared.load() == nullptr) {
+    std::this_thread::yield();
   }
-
-  return total;
-}
-
-size_t align(size_t size) {
-  return (size + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
-}
-
-size_t allocSize(size_t size) { return size + sizeof(Block); }
-
-Block *requestFromOS(size_t size) {
-  size = allocSize(size); // Prevent SegFault
-  void *block{nullptr};
-
-  if (size > M_MMAP_THRESHOLD) {
-    block = mmap(nullptr, size, PROT_WRITE | PROT_WRITE,
-                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(errno == 0 && "mmap failed to allocate memory");
-  } else {
-    block = sbrk(size);
-    assert(errno == 0 && "sbrk failed to allocate memory");
+  memalloc::free(shared.load()); // Remote free, the producer is still alive
+  freed.store(true);
+  producer.join();
+
+  void *b4{alloc(64 * 1024)}; // Heap has no fixed cap anymore
+  assert(b4 != nullptr && !getHeader(b4)->mmapped);
+  std::memset(b4, 0xff, 64 * 1024);
+  memalloc::free(b4);
+  char *c1{static_cast<char *>(memalloc::calloc(1024, 64))}; // Reuses b4
+  assert(c1 == b4);
+  for (size_t i{}; i < 64 * 1024; i++) {
+    assert(c1[i] == 0);
   }
-
-  return static_cast<Block *>(block);
-}
-
-Block *findBlock(size_t size) {
-  if (free_list.size() == 0)
-    return nullptr;
-  for (const auto &block : free_list) {
-    if (block->size >= size) {
-      return block;
-    }
+  memalloc::free(c1);
+
+  void *a1{memalloc::alignedAlloc(4096, 100)};
+  assert(reinterpret_cast<uintptr_t>(a1) % 4096 == 0);
+  assert(memalloc::usableSize(a1) >= 100);
+  memalloc::free(a1);
+
+  // Sizes that would wrap once padded fail instead of corrupting the heap
+  [[maybe_unused]] void *huge{alloc(SIZE_MAX)};
+  assert(huge == nullptr);
+  huge = alloc(SIZE_MAX - 8);
+  assert(huge == nullptr);
+  huge = memalloc::alignedAlloc(4096, SIZE_MAX - 100);
+  assert(huge == nullptr);
+  huge = memalloc::alignedAlloc(64, SIZE_MAX - 40);
+  assert(huge == nullptr);
+  huge = memalloc::calloc(SIZE_MAX / 2, 4);
+  assert(huge == nullptr);
+  void *kept{alloc(100)};
+  huge = memalloc::realloc(kept, SIZE_MAX);
+  assert(huge == nullptr);
+  memalloc::free(kept); // Still owned after the failed realloc
+
+  char *r1{static_cast<char *>(alloc(1000))};
+  void *r2{alloc(1000)}; // Right after r1, freed into the heap
+  void *r3{alloc(1000)}; // Keeps r2 from merging further
+  std::memset(r1, 0x33, 1000);
+  memalloc::free(r2);
+  char *grown{static_cast<char *>(memalloc::realloc(r1, 1800))};
+  assert(grown == r1); // Took the free successor
+  assert(grown[999] == 0x33);
+  char *shrunk{static_cast<char *>(memalloc::realloc(grown, 400))};
+  assert(shrunk == r1 && getHeader(shrunk)->size == 400);
+  memalloc::free(shrunk);
+  memalloc::free(r3);
+
+  const size_t large{size_t{1} << 20};
+  char *b5{static_cast<char *>(alloc(large))}; // Allocates using mmap
+  assert(getHeader(b5)->mmapped);
+  std::memset(b5, 0x5a, large);
+
+  b5 = static_cast<char *>(memalloc::realloc(b5, 4 * large)); // mremap
+  assert(getHeader(b5)->size >= 4 * large);
+  assert(b5[0] == 0x5a && b5[large - 1] == 0x5a);
+
+  memalloc::free(b5); // Unmapped, the threshold follows the freed size
+  assert(memalloc::mmapThreshold() >= 4 * large);
+
+  void *a2{memalloc::alignedAlloc(size_t{1} << 16, 8 * large)};
+  assert(getHeader(a2)->mmapped);
+  assert(reinterpret_cast<uintptr_t>(a2) % (size_t{1} << 16) == 0);
+  memalloc::free(a2);
+
+  size_t allocated{}, requests{}, length{sizeof(size_t)};
+  [[maybe_unused]] int error{memalloc::mallctl(
+      "stats.allocated", &allocated, &length, nullptr, 0)};
+  assert(error == 0);
+  error = memalloc::mallctl("stats.class.1.requests", &requests, &length,
+                            nullptr, 0);
+  assert(error == 0);
+  void *s1{alloc(300)}; // First level class 1 holds [256, 512)
+  size_t after{}, after_requests{};
+  memalloc::mallctl("stats.allocated", &after, &length, nullptr, 0);
+  memalloc::mallctl("stats.class.1.requests", &after_requests, &length,
+                    nullptr, 0);
+  assert(after == allocated + memalloc::usableSize(s1));
+  assert(after_requests == requests + 1);
+  memalloc::free(s1);
+  memalloc::mallctl("stats.allocated", &after, &length, nullptr, 0);
+  assert(after == allocated);
+  error = memalloc::mallctl("stats.allocated", nullptr, nullptr, &after,
+                            sizeof(after));
+  assert(error == EPERM);
+  error = memalloc::mallctl("stats.nope", nullptr, nullptr, nullptr, 0);
+  assert(error == ENOENT);
+
+  // Peaks between two reads still count, whichever path served them
+  void *spike{alloc(32 * large)};
+  memalloc::free(spike);
+  for (int i{}; i < 1000; i++) {
+    memalloc::free(alloc(1000));
   }
-
-  return nullptr;
-}
-
-bool canCoalesce(Block *block) {
-  return (block->next != nullptr && !block->next->inuse) ||
-         (block->prev != nullptr && !block->prev->inuse);
-}
-
-void coalesce(Block *block) {
-  if (block->next != nullptr && !block->next->inuse) {
-    block->size += block->next->size;
-    block->next = block->next->next;
+  size_t peak{};
+  memalloc::mallctl("stats.peak.allocated", &peak, &length, nullptr, 0);
+  assert(peak >= 32 * large);
+
+  memalloc::Stats stats;
+  memalloc::readStats(stats);
+  assert(stats.peak_mapped >= 8 * large);
+  assert(stats.fragmentation >= 0.0 && stats.fragmentation < 1.0);
+  char json[8192];
+  length = sizeof(json);
+  error = memalloc::mallctl("stats.json", json, &length, nullptr, 0);
+  assert(error == 0);
+  assert(json[0] == '{' && length == std::strlen(json) + 1);
+
+  {
+    struct Node {
+      Node *next;
+      int key;
+      std::string *owned;
+      ~Node() { delete owned; }
+    };
+    memalloc::Pool<Node> nodes;
+    Node *n1{nodes.create(Node{nullptr, 1, nullptr})};
+    Node *n2{nodes.create(Node{n1, 2, nullptr})};
+    // No header between slots, the second comes right after the first
+    assert(reinterpret_cast<char *>(n2) - reinterpret_cast<char *>(n1) ==
+           sizeof(Node));
+    nodes.destroy(n1);
+    [[maybe_unused]] Node *n3{nodes.create(Node{nullptr, 3, nullptr})};
+    assert(n3 == n1); // LIFO reuse
+    n2->owned = new std::string(64, 'x'); // Freed by ~Pool
   }
-
-  if (block->prev != nullptr && !block->prev->inuse) {
-    block->size += block->prev->size;
-    block->prev = block->prev->prev;
-    block->prev->next = block;
+  {
+    memalloc::SlabPool slabs{24};
+    assert(slabs.slotSize() == 32);
+    std::vector<void *> slots(3 * memalloc::SlabPool::MAX_SLAB_SLOTS);
+    for (void *&slot : slots) {
+      slot = slabs.allocate();
+      assert(reinterpret_cast<uintptr_t>(slot) % 16 == 0);
+    }
+    size_t live{};
+    slabs.forEach([&](char *) { live++; });
+    assert(live == slots.size());
+    for (size_t i{}; i < slots.size(); i += 2) {
+      slabs.deallocate(slots[i]);
+    }
+    live = 0;
+    slabs.forEach([&](char *) { live++; });
+    assert(live == slots.size() / 2);
   }
-}
-
-bool canSplit(Block *block, size_t size) { return (block->size > size); }
-
-Block *split(Block *block, size_t size) {
-  Block *newBlock{block + allocSize(size)}; // get splitting pointer
-  newBlock->inuse = false;
-  newBlock->size = block->size - size;
-  newBlock->next = block->next;
-
-  block->next = newBlock;
-  block->size = size;
-  newBlock->prev = block;
-
-  return block;
-}
-
-void *alloc(size_t size) {
-  size = align(size);
-
-  if (memorySize() + size > MAX_SIZE) {
-    return nullptr;
+  {
+    memalloc::PoolResource resource;
+    std::pmr::list<int> list{&resource};
+    for (int i{}; i < 1000; i++) {
+      list.push_back(i);
+    }
+    assert(list.size() == 1000 && list.back() == 999);
+
+    using Allocator = memalloc::PoolAllocator<std::pair<const int, int>>;
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                       Allocator>
+        map{16, std::hash<int>{}, std::equal_to<int>{}, Allocator{resource}};
+    for (int i{}; i < 10000; i++) {
+      map[i] = i * 2;
+    }
+    for (int i{}; i < 10000; i += 2) {
+      map.erase(i);
+    }
+    assert(map.size() == 5000 && map.at(9999) == 19998);
   }
 
-  Block *block{findBlock(size)};
-  free_list.erase(std::remove(free_list.begin(), free_list.end(), block),
-                  free_list.end());
-
-  if (block == nullptr) {
-    block = requestFromOS(size);
-
-    if (head == nullptr) {
-      head = block;
-    } else {
-      Block *curr{head};
-      while (curr->next != nullptr) // O(n)
+  {
+    memalloc::ChunkCache chunks{1 << 20};
+    memalloc::Arena arena{1024, &chunks};
+    char *a1{static_cast<char *>(arena.alloc(10))};
+    [[maybe_unused]] char *a2{static_cast<char *>(arena.alloc(10, 64))};
+    assert(a2 > a1 && reinterpret_cast<uintptr_t>(a2) % 64 == 0);
+    arena.free(a1); // No-op
+
+    [[maybe_unused]] memalloc::Arena::Mark outer{arena.save()};
+    {
+      memalloc::Arena::Scope scope{arena};
+      for (int i{}; i < 100; i++) {
+        arena.alloc(100); // Spills into doubling chunks
+      }
+      assert(arena.chunkCount() > 1);
       {
-        curr = curr->next;
+        memalloc::Arena::Scope inner{arena};
+        arena.alloc(5000);
       }
-
-      curr->next = block;
-      block->prev = curr;
     }
-
-    block->size = size;
-    block->inuse = true;
-
-    return block;
+    assert(arena.chunkCount() == 1);
+    assert(arena.save().ptr == outer.ptr);
+    [[maybe_unused]] void *resumed{arena.alloc(16, 1)};
+    assert(resumed == outer.ptr); // Bump resumes at the mark
+
+    std::pmr::vector<int> ints{&arena};
+    ints.resize(10000, 7);
+    assert(ints[9999] == 7);
   }
-
-  block->inuse = true;
-
-  if (canSplit(block, size)) {
-    block = split(block, size);
+  {
+    memalloc::ChunkCache chunks{1 << 20};
+    [[maybe_unused]] void *first{};
+    {
+      memalloc::Arena request{4096, &chunks};
+      first = request.alloc(100);
+    }
+    assert(chunks.cachedBytes() > 0);
+    memalloc::Arena request{4096, &chunks};
+    [[maybe_unused]] void *second{request.alloc(100)};
+    assert(second == first); // Chunk recycled between arenas
+    assert(chunks.cachedBytes() == 0);
   }
 
-  return block;
-}
-
-void free(void *ptr) {
-  Block *curr{head};
-
-  while (curr != nullptr) {
-    if (curr == ptr) {
-      curr->inuse = false;
-
-      if (canCoalesce(curr)) {
-        coalesce(curr);
+  {
+    char *burst{static_cast<char *>(alloc(large))}; // Under the threshold
+    void *guard{alloc(64)}; // Keeps burst from merging with the top
+    assert(!getHeader(burst)->mmapped);
+    std::memset(burst, 0x5a, large);
+    memalloc::free(burst);
+    [[maybe_unused]] size_t released{memalloc::trim()};
+    assert(released >= large - 2 * 4096);
+    memalloc::readStats(stats);
+    assert(stats.purged >= released);
+    assert(stats.resident == stats.heap_mapped + stats.large_mapped -
+                                 stats.purged);
+
+    void *reused{alloc(large)}; // Purged pages are resident again
+    assert(reused == burst);
+    memalloc::readStats(stats);
+    assert(stats.purged + large <= released);
+    memalloc::free(reused);
+
+    memalloc::setDecayMs(0); // Purge on every heap operation
+    char *again{static_cast<char *>(alloc(large))};
+    memalloc::free(again);
+    memalloc::readStats(stats);
+    assert(stats.purged >= large - 2 * 4096);
+    memalloc::setDecayMs(1000);
+    memalloc::free(guard);
+
+    char *left{static_cast<char *>(alloc(large))};
+    void *right{alloc(8 * 4096)}; // Merges into left once freed
+    guard = alloc(64);
+    std::memset(left, 0x5a, large);
+    memalloc::free(left);
+    memalloc::trim();
+    memalloc::readStats(stats);
+    [[maybe_unused]] size_t purged{stats.purged};
+    memalloc::free(right); // Stays resident until the merged block ages
+    memalloc::readStats(stats);
+    assert(stats.purged == purged); // left is still counted as purged
+    assert(stats.resident == stats.heap_mapped + stats.large_mapped -
+                                 stats.purged);
+    released = memalloc::trim(); // Only the pages right brought in
+    assert(released >= 8 * 4096 - 4096 && released < large);
+    memalloc::free(guard);
+
+    // Cached frees tick the decay clock without reaching the heap
+    memalloc::setDecayMs(10);
+    void *idle{alloc(large)};
+    guard = alloc(1024); // Past the thread cache, so right after idle
+    std::memset(idle, 0x5a, large);
+    memalloc::free(idle);
+    memalloc::readStats(stats);
+    purged = stats.purged;
+    for (int tick{}; tick < 3; tick++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      for (int i{}; i < 200; i++) {
+        memalloc::free(alloc(32));
       }
-
-      free_list.push_back(curr);
-
-      return;
     }
-
-    curr = curr->next;
+    memalloc::readStats(stats);
+    assert(stats.purged >= purged + large - 2 * 4096);
+    memalloc::setDecayMs(1000);
+    memalloc::free(guard);
+
+    memalloc::setRssLimit(memalloc::residentSize() + 64 * 1024);
+    [[maybe_unused]] void *over{alloc(16 * large)};
+    assert(over == nullptr); // Neither heap nor mapping fits
+    void *small{alloc(1024)};
+    assert(small != nullptr);
+    memalloc::free(small);
+    memalloc::setRssLimit(0);
+    void *unlimited{alloc(16 * large)};
+    assert(unlimited != nullptr);
+    memalloc::free(unlimited);
   }
 
-  return;
-}
-
-void printMemory() {
-  Block *curr{head};
-  while (curr != nullptr) {
-    std::cout << '[' << curr->size << ", " << curr->inuse << "] -> ";
-    curr = curr->next;
+  {
+    // A mapping at the break makes sbrk fail, aligned requests then fall
+    // back to a mapping of their own like alloc does
+    uintptr_t end{reinterpret_cast<uintptr_t>(sbrk(0))};
+    char *brk{reinterpret_cast<char *>((end + 4095) & ~uintptr_t{4095})};
+    void *wall{mmap(brk, 64 * large, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0)};
+    assert(wall == brk);
+    memalloc::readStats(stats);
+    const size_t threshold{memalloc::mmapThreshold()};
+    const size_t size{stats.largest_free + large}; // Needs a heap extension
+    memalloc::setMmapThreshold(2 * size);
+    void *heap_only{alloc(size)};
+    assert(heap_only != nullptr && getHeader(heap_only)->mmapped);
+    void *aligned{memalloc::alignedAlloc(4096, size)};
+    assert(aligned != nullptr && getHeader(aligned)->mmapped);
+    assert(reinterpret_cast<uintptr_t>(aligned) % 4096 == 0);
+    memalloc::free(aligned);
+    memalloc::free(heap_only);
+    memalloc::setMmapThreshold(threshold);
+    munmap(wall, 64 * large);
   }
 
-  std::cout << "nullptr\n";
-}
-
-int blocksAvailable() {
-  Block *curr{head};
-  int n_blocks{};
-  while (curr != nullptr) {
-    n_blocks++;
-    curr = curr->next;
-  }
-
-  return n_blocks;
-}
-
-void resetHeap() {
-  if (head == nullptr)
-    return; // already reset
-
-  brk(head);
-
-  head = nullptr;
-  return;
-}
-
-int main() {
-  Block *b1{static_cast<Block *>(alloc(15))}; // [16, 1]
-  assert(b1->size == 16);
-  assert(b1->inuse);
-  free(b1); // [16, 0]
-  assert(!b1->inuse);
-
-  Block *b2{static_cast<Block *>(alloc(8))}; // [8, 1] -> [8, 0]
-  assert(b2->size == 8);
-  assert(blocksAvailable() == 2);
-  assert(b1 == b2);
-
-  Block *b3{static_cast<Block *>(alloc(12))}; // [8, 1] -> [8, 0] -> [16, 1]
-  free(b3);                                   // [8, 1] -> [24, 0]
-  free(b2);                                   // [32, 0]
-  assert(b2->size == 32);
-  assert(blocksAvailable() == 1);
-
-  Block *b4{static_cast<Block *>(alloc(4097))}; // Out of memory
-  assert(b4 == nullptr);
-
-  Block *b5{static_cast<Block *>(alloc(2034))}; // Allocates using mmap
-  assert(b5 != nullptr);
-
   std::cout << "\nAll assertions passed\n\n";
 
   return 0;
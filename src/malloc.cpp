@@ -0,0 +1,251 @@
+/** Includes **/
+#include "memalloc.hpp"
+#include "trace.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <malloc.h>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+
+/** C allocation ABI exported by libmemalloc.so, usable through LD_PRELOAD.
+ * Nothing here may reach libc's malloc, the allocator state is constant
+ * initialised so the first call can come before any constructor runs. **/
+
+#define MEMALLOC_EXPORT extern "C" __attribute__((visibility("default")))
+
+namespace {
+
+using memalloc::trace::Op;
+
+/** Calls are recorded to MEMALLOC_TRACE when set, the buffer is written
+ * with write(2) so recording never allocates **/
+std::atomic<int> trace_fd{-1};
+std::mutex trace_mutex;
+unsigned char trace_buffer[64 * 1024];
+size_t trace_used{};
+
+void traceFlush() {
+  size_t done{};
+  while (done < trace_used) {
+    ssize_t n{write(trace_fd.load(std::memory_order_relaxed),
+                    trace_buffer + done, trace_used - done)};
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  trace_used = 0;
+}
+
+bool tracing() { return trace_fd.load(std::memory_order_relaxed) >= 0; }
+
+void record(Op op, uint64_t a, uint64_t b = 0, uint64_t c = 0) {
+  if (!tracing())
+    return;
+
+  std::lock_guard<std::mutex> lock{trace_mutex};
+  if (trace_used + memalloc::trace::MAX_RECORD_SIZE > sizeof(trace_buffer)) {
+    traceFlush();
+  }
+
+  unsigned char *out{trace_buffer + trace_used};
+  size_t n{};
+  out[n++] = static_cast<unsigned char>(op);
+  n += memalloc::trace::writeVarint(out + n, a);
+  if (memalloc::trace::argCount(op) > 1) {
+    n += memalloc::trace::writeVarint(out + n, b);
+  }
+  if (memalloc::trace::argCount(op) > 2) {
+    n += memalloc::trace::writeVarint(out + n, c);
+  }
+  trace_used += n;
+}
+
+uint64_t addr(void *ptr) { return reinterpret_cast<uintptr_t>(ptr); }
+
+void tracePrepare() { trace_mutex.lock(); }
+
+void traceParent() { trace_mutex.unlock(); }
+
+/** The child does not append to its parent's trace **/
+void traceChild() {
+  trace_used = 0;
+  trace_fd.store(-1, std::memory_order_relaxed);
+  trace_mutex.unlock();
+}
+
+__attribute__((constructor)) void startTrace() {
+  const char *path{getenv("MEMALLOC_TRACE")};
+  if (path == nullptr || *path == '\0')
+    return;
+
+  int fd{open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+  if (fd < 0)
+    return;
+
+  unsigned char header[sizeof(memalloc::trace::MAGIC) + 1];
+  for (size_t i{}; i < sizeof(memalloc::trace::MAGIC); i++) {
+    header[i] = memalloc::trace::MAGIC[i];
+  }
+  header[sizeof(memalloc::trace::MAGIC)] = memalloc::trace::VERSION;
+  if (write(fd, header, sizeof(header)) != sizeof(header)) {
+    close(fd);
+    return;
+  }
+
+  pthread_atfork(tracePrepare, traceParent, traceChild);
+  trace_fd.store(fd, std::memory_order_relaxed);
+}
+
+__attribute__((destructor)) void stopTrace() {
+  if (!tracing())
+    return;
+
+  std::lock_guard<std::mutex> lock{trace_mutex};
+  traceFlush();
+}
+
+bool isPowerOfTwo(size_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+void *checked(void *ptr) {
+  if (ptr == nullptr) {
+    errno = ENOMEM;
+  }
+
+  return ptr;
+}
+
+__attribute__((constructor)) void registerForkHandlers() {
+  pthread_atfork(memalloc::forkPrepare, memalloc::forkParent,
+                 memalloc::forkChild);
+}
+
+/** Purging options for programs run under LD_PRELOAD **/
+__attribute__((constructor)) void configure() {
+  const char *decay{getenv("MEMALLOC_DECAY_MS")};
+  if (decay != nullptr && *decay != '\0') {
+    memalloc::setDecayMs(strtoull(decay, nullptr, 10));
+  }
+
+  const char *limit{getenv("MEMALLOC_RSS_LIMIT")};
+  if (limit != nullptr && *limit != '\0') {
+    memalloc::setRssLimit(strtoull(limit, nullptr, 10));
+  }
+
+  const char *lazy{getenv("MEMALLOC_PURGE_LAZY")};
+  memalloc::setPurgeLazy(lazy != nullptr && *lazy == '1');
+}
+
+} // namespace
+
+MEMALLOC_EXPORT void *malloc(size_t size) noexcept {
+  void *ptr{memalloc::alloc(size)};
+  record(Op::Malloc, size, addr(ptr));
+  return checked(ptr);
+}
+
+MEMALLOC_EXPORT void free(void *ptr) noexcept {
+  if (ptr != nullptr) {
+    record(Op::Free, addr(ptr));
+  }
+  memalloc::free(ptr);
+}
+
+MEMALLOC_EXPORT void *calloc(size_t count, size_t size) noexcept {
+  void *ptr{memalloc::calloc(count, size)};
+  record(Op::Calloc, count * size, addr(ptr));
+  return checked(ptr);
+}
+
+MEMALLOC_EXPORT void *realloc(void *ptr, size_t size) noexcept {
+  if (ptr != nullptr && size == 0) {
+    record(Op::Free, addr(ptr));
+    memalloc::free(ptr);
+    return nullptr;
+  }
+
+  if (!tracing() || ptr == nullptr) {
+    void *resized{memalloc::realloc(ptr, size)};
+    record(Op::Realloc, addr(ptr), size, addr(resized));
+    return checked(resized);
+  }
+
+  // Traced reallocs always move and record before ptr is freed, so no
+  // other thread can reuse the address and record it first
+  void *resized{memalloc::alloc(size)};
+  if (resized != nullptr) {
+    size_t used{memalloc::usableSize(ptr)};
+    std::memcpy(resized, ptr, used < size ? used : size);
+  }
+  record(Op::Realloc, addr(ptr), size, addr(resized));
+  if (resized != nullptr) {
+    memalloc::free(ptr);
+  }
+  return checked(resized);
+}
+
+MEMALLOC_EXPORT int posix_memalign(void **memptr, size_t alignment,
+                                   size_t size) noexcept {
+  if (!isPowerOfTwo(alignment) || alignment % sizeof(void *) != 0)
+    return EINVAL;
+
+  void *ptr{memalloc::alignedAlloc(alignment, size)};
+  record(Op::Aligned, alignment, size, addr(ptr));
+  if (ptr == nullptr)
+    return ENOMEM;
+
+  *memptr = ptr;
+  return 0;
+}
+
+MEMALLOC_EXPORT void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  if (!isPowerOfTwo(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+
+  void *ptr{memalloc::alignedAlloc(alignment, size)};
+  record(Op::Aligned, alignment, size, addr(ptr));
+  return checked(ptr);
+}
+
+MEMALLOC_EXPORT void *memalign(size_t alignment, size_t size) noexcept {
+  return aligned_alloc(alignment, size);
+}
+
+MEMALLOC_EXPORT void *valloc(size_t size) noexcept {
+  return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+MEMALLOC_EXPORT void *pvalloc(size_t size) noexcept {
+  size_t page_size{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+  return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+MEMALLOC_EXPORT size_t malloc_usable_size(void *ptr) noexcept {
+  return memalloc::usableSize(ptr);
+}
+
+/** jemalloc style introspection, names are listed in stats.cpp **/
+MEMALLOC_EXPORT int mallctl(const char *name, void *oldp, size_t *oldlenp,
+                            void *newp, size_t newlen) noexcept {
+  return memalloc::mallctl(name, oldp, oldlenp, newp, newlen);
+}
+
+/** Returns 1 if pages were given back, like glibc. The heap is not
+ * shrunk from its top so pad has nothing to keep. **/
+MEMALLOC_EXPORT int malloc_trim(size_t) noexcept {
+  memalloc::flushThreadCache();
+  return memalloc::trim() > 0 ? 1 : 0;
+}
+
+/** glibc's malloc_stats prints to stderr, here as one JSON line **/
+MEMALLOC_EXPORT void malloc_stats() noexcept {
+  memalloc::dumpStats(STDERR_FILENO);
+}
@@ -0,0 +1,1395 @@
+/** Includes **/
+#include "memalloc.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace memalloc {
+
+/** Payloads are aligned for any fundamental type, as malloc requires **/
+constexpr size_t ALIGNMENT{alignof(std::max_align_t)};
+
+constexpr size_t HEAP_GROWTH{128 * 1024}; // Minimum sbrk increment
+
+/** Requests past PTRDIFF_MAX fail like glibc's, the margin absorbs the
+ * header, alignment and page rounding added to a request **/
+constexpr size_t MAX_REQUEST_SIZE{PTRDIFF_MAX - (size_t{1} << 20)};
+
+/** Large objects get their own mapping, the threshold adapts like glibc's **/
+constexpr size_t DEFAULT_MMAP_THRESHOLD{128 * 1024};
+constexpr size_t DEFAULT_MMAP_THRESHOLD_MAX{32 * 1024 * 1024};
+
+/** Free heap pages are purged once unused for the decay time, the decay
+ * only visits blocks of PURGE_MIN_SIZE or more to keep ticks cheap **/
+constexpr size_t DEFAULT_DECAY_MS{1000};
+constexpr size_t PURGE_MIN_SIZE{64 * 1024};
+
+/** Two-level segregated fit (TLSF) free list parameters **/
+constexpr size_t ALIGN_SIZE_LOG2{4};    // log2(ALIGNMENT)
+constexpr size_t SL_INDEX_COUNT_LOG2{4}; // Second level subdivisions (log2)
+constexpr size_t SL_INDEX_COUNT{1 << SL_INDEX_COUNT_LOG2};
+constexpr size_t FL_INDEX_SHIFT{SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2};
+constexpr size_t FL_INDEX_MAX{48}; // Largest size class is 2^48 bytes
+constexpr size_t FL_INDEX_COUNT{FL_INDEX_MAX - FL_INDEX_SHIFT + 1};
+constexpr size_t SMALL_BLOCK_SIZE{1 << FL_INDEX_SHIFT}; // Linear below this
+
+/** Slots fold their allocated byte changes into the shared live count
+ * past this, so peak_allocated is exact within LIVE_BATCH per thread **/
+constexpr int64_t LIVE_BATCH{64 * 1024};
+
+/** Per-thread cache parameters **/
+constexpr size_t CACHE_MAX_SIZE{256}; // Largest block kept in a thread cache
+constexpr size_t CACHE_CLASS_COUNT{CACHE_MAX_SIZE / ALIGNMENT};
+constexpr uint32_t CACHE_BIN_LIMIT{64}; // Half a bin goes back past this
+constexpr uint32_t DECAY_CHECK_FREES{64}; // Cached frees per clock check
+constexpr size_t MAX_THREAD_CACHES{128};
+constexpr size_t CACHE_LINE_SIZE{64};
+
+static_assert(sizeof(Block) % ALIGNMENT == 0, "Payloads must stay aligned");
+static_assert(SIZE_CLASS_COUNT == FL_INDEX_COUNT,
+              "Statistics are kept per first level class");
+
+static Block *head{nullptr};            // First block of the heap
+static Block *tail{nullptr};            // Epilogue of the last segment
+static char *heap_end{nullptr};         // Break left by our last sbrk
+static std::atomic<size_t> heap_size{}; // Bytes obtained from the OS
+
+/** Free blocks are segregated by size class, bitmaps mark non-empty lists **/
+static Block *free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT]{};
+static uint64_t fl_bitmap{};
+static uint32_t sl_bitmap[FL_INDEX_COUNT]{};
+
+static std::mutex heap_mutex; // Guards the heap and its free lists
+
+/** Heap statistics per first level class, guarded by heap_mutex **/
+static size_t free_bytes[FL_INDEX_COUNT]{};
+static uint64_t split_count[FL_INDEX_COUNT]{};
+static uint64_t coalesce_count[FL_INDEX_COUNT]{};
+
+/** Live large objects, linked through prev/next, page granular **/
+static Block *large_spans{nullptr};
+static std::atomic<size_t> large_size{}; // Bytes mapped for large objects
+static size_t large_mapped[FL_INDEX_COUNT]{};
+static std::mutex large_mutex;
+static std::atomic<size_t> mmap_threshold{DEFAULT_MMAP_THRESHOLD};
+
+static std::atomic<int64_t> live_bytes{}; // Less what slots still batch
+static std::atomic<size_t> peak_allocated{};
+static std::atomic<size_t> peak_mapped{};
+
+static std::atomic<size_t> purged_size{}; // Free heap bytes given back
+static std::atomic<size_t> decay_ms{DEFAULT_DECAY_MS};
+static std::atomic<bool> purge_lazy{false};
+static std::atomic<size_t> rss_limit{};
+static uint8_t decay_epoch{}; // Decay state, guarded by heap_mutex
+static std::atomic<uint64_t> decay_last{}; // Also read by cached frees
+
+/** Allocation counters, each thread cache slot has its own set written
+ * only by its thread and summed when statistics are read **/
+struct ThreadStats {
+  std::atomic<int64_t> allocated[FL_INDEX_COUNT]{}; // Can dip below zero
+  std::atomic<uint64_t> requests[FL_INDEX_COUNT]{};
+  int64_t pending{}; // Owner only, batched into live_bytes
+};
+
+/** Blocks cached by a thread stay inuse for the heap, linked through next.
+ * Slots start on their own cache line and what other threads touch, the
+ * remote free queue and the claim flag, sits on a line of its own, so
+ * remote frees do not bounce the owner's bins. **/
+struct alignas(CACHE_LINE_SIZE) ThreadCache {
+  Block *bins[CACHE_CLASS_COUNT]{};
+  uint32_t counts[CACHE_CLASS_COUNT]{};
+  uint32_t decay_countdown{}; // Cached frees left before the clock check
+  ThreadStats stats;
+
+  // Pushed by other threads
+  alignas(CACHE_LINE_SIZE) std::atomic<Block *> remote_frees{nullptr};
+  std::atomic<bool> claimed{false}; // Owned by a live thread
+};
+
+static ThreadCache thread_caches[MAX_THREAD_CACHES];
+static ThreadStats shared_stats; // Threads that did not get a cache slot
+// Initial-exec TLS, so the first access from the preloaded library never
+// allocates
+__attribute__((tls_model("initial-exec"))) static thread_local ThreadCache
+    *thread_cache{nullptr};
+__attribute__((tls_model("initial-exec"))) static thread_local bool
+    thread_cache_init{false};
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_once{PTHREAD_ONCE_INIT};
+
+size_t memorySize() {
+  return heap_size.load(std::memory_order_relaxed) +
+         large_size.load(std::memory_order_relaxed);
+}
+
+size_t mmapThreshold() {
+  return mmap_threshold.load(std::memory_order_relaxed);
+}
+
+void setMmapThreshold(size_t threshold) {
+  mmap_threshold.store(threshold, std::memory_order_relaxed);
+}
+
+size_t decayMs() { return decay_ms.load(std::memory_order_relaxed); }
+
+void setDecayMs(size_t ms) { decay_ms.store(ms, std::memory_order_relaxed); }
+
+bool purgeLazy() { return purge_lazy.load(std::memory_order_relaxed); }
+
+void setPurgeLazy(bool lazy) {
+  purge_lazy.store(lazy, std::memory_order_relaxed);
+}
+
+size_t residentSize() {
+  return memorySize() - purged_size.load(std::memory_order_relaxed);
+}
+
+size_t rssLimit() { return rss_limit.load(std::memory_order_relaxed); }
+
+void setRssLimit(size_t limit) {
+  rss_limit.store(limit, std::memory_order_relaxed);
+}
+
+bool overLimit(size_t growth) {
+  size_t limit{rssLimit()};
+  return limit != 0 && residentSize() + growth > limit;
+}
+
+/** Purges the heap when growth would cross the limit, takes heap_mutex **/
+bool withinLimit(size_t growth) {
+  if (!overLimit(growth))
+    return true;
+
+  trim();
+  return !overLimit(growth);
+}
+
+void raisePeak(std::atomic<size_t> &peak, size_t value) {
+  size_t current{peak.load(std::memory_order_relaxed)};
+  while (current < value &&
+         !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    ;
+}
+
+size_t align(size_t size) { return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+
+char *alignUp(char *ptr, size_t alignment) {
+  uintptr_t addr{reinterpret_cast<uintptr_t>(ptr)};
+  return reinterpret_cast<char *>((addr + alignment - 1) & ~(alignment - 1));
+}
+
+char *alignDown(char *ptr, size_t alignment) {
+  uintptr_t addr{reinterpret_cast<uintptr_t>(ptr)};
+  return reinterpret_cast<char *>(addr & ~(alignment - 1));
+}
+
+size_t allocSize(size_t size) { return size + sizeof(Block); }
+
+/** Header and payload are found from each other by pointer arithmetic **/
+Block *getHeader(void *ptr) {
+  return reinterpret_cast<Block *>(static_cast<char *>(ptr) - sizeof(Block));
+}
+
+void *getPayload(Block *block) {
+  return reinterpret_cast<char *>(block) + sizeof(Block);
+}
+
+/** Physical neighbours, prevBlock() is only valid when !prev_inuse **/
+Block *nextBlock(Block *block) {
+  return reinterpret_cast<Block *>(reinterpret_cast<char *>(block) +
+                                   allocSize(block->size));
+}
+
+size_t *getFooter(Block *block) {
+  return reinterpret_cast<size_t *>(static_cast<char *>(getPayload(block)) +
+                                    block->size - sizeof(size_t));
+}
+
+Block *prevBlock(Block *block) {
+  size_t prev_size{*(reinterpret_cast<size_t *>(block) - 1)};
+  return reinterpret_cast<Block *>(reinterpret_cast<char *>(block) -
+                                   allocSize(prev_size));
+}
+
+size_t pageSize() {
+  static const size_t page_size{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+  return page_size;
+}
+
+size_t pageAlign(size_t size) {
+  return (size + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+/** The heap only grows through sbrk, large objects are mapped apart **/
+void *requestFromOS(size_t size) {
+  void *block{sbrk(size)};
+  if (block == reinterpret_cast<void *>(-1))
+    return nullptr;
+
+  return block;
+}
+
+/** Index of the most significant set bit, size must be non zero **/
+size_t fls(size_t size) { return 63 - __builtin_clzll(size); }
+
+/** Index of the least significant set bit, word must be non zero **/
+size_t ffs(uint64_t word) { return __builtin_ctzll(word); }
+
+/** Size class holding blocks of exactly this size **/
+void mappingInsert(size_t size, size_t &fl, size_t &sl) {
+  if (size < SMALL_BLOCK_SIZE) {
+    fl = 0;
+    sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    return;
+  }
+
+  if (size >= (size_t{1} << FL_INDEX_MAX)) {
+    size = (size_t{1} << FL_INDEX_MAX) - 1; // Clamp to the last class
+  }
+
+  fl = fls(size);
+  sl = (size >> (fl - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+  fl -= FL_INDEX_SHIFT - 1;
+}
+
+/** Size class whose blocks are all large enough for size (good-fit) **/
+void mappingSearch(size_t size, size_t &fl, size_t &sl) {
+  if (size >= SMALL_BLOCK_SIZE) {
+    size += (size_t{1} << (fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+  }
+
+  mappingInsert(size, fl, sl);
+}
+
+size_t sizeClass(size_t size) {
+  size_t fl, sl;
+  mappingInsert(size, fl, sl);
+  return fl;
+}
+
+/** Slot counters have a single writer, a load and a store is enough **/
+template <typename T>
+void bump(std::atomic<T> &counter, T value, ThreadCache *cache) {
+  if (cache != nullptr) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  } else {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+}
+
+/** Moves the live byte count on, raising the high-water mark as it
+ * grows. Slots only touch the shared counter once per LIVE_BATCH. **/
+void countLive(ThreadCache *cache, int64_t bytes) {
+  if (cache != nullptr) {
+    bytes += cache->stats.pending;
+    if (bytes < LIVE_BATCH && bytes > -LIVE_BATCH) {
+      cache->stats.pending = bytes;
+      return;
+    }
+    cache->stats.pending = 0;
+  }
+
+  int64_t live{live_bytes.fetch_add(bytes, std::memory_order_relaxed) +
+               bytes};
+  if (live > 0) {
+    raisePeak(peak_allocated, live);
+  }
+}
+
+void countAlloc(ThreadCache *cache, size_t size) {
+  ThreadStats &stats{cache != nullptr ? cache->stats : shared_stats};
+  size_t index{sizeClass(size)};
+  bump<int64_t>(stats.allocated[index], size, cache);
+  bump<uint64_t>(stats.requests[index], 1, cache);
+  countLive(cache, size);
+}
+
+void countFree(ThreadCache *cache, size_t size) {
+  ThreadStats &stats{cache != nullptr ? cache->stats : shared_stats};
+  bump<int64_t>(stats.allocated[sizeClass(size)], -int64_t(size), cache);
+  countLive(cache, -int64_t(size));
+}
+
+int64_t allocatedBytes(size_t index) {
+  int64_t total{shared_stats.allocated[index].load(std::memory_order_relaxed)};
+  for (auto &cache : thread_caches) {
+    total += cache.stats.allocated[index].load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+size_t allocatedBytes() {
+  int64_t total{};
+  for (size_t i{}; i < FL_INDEX_COUNT; i++) {
+    total += allocatedBytes(i);
+  }
+
+  return total > 0 ? total : 0;
+}
+
+/** Whole pages inside a free block's payload. Its first word and the
+ * footer stay resident. **/
+size_t purgeRun(Block *block, char *&start) {
+  start = alignUp(static_cast<char *>(getPayload(block)) + sizeof(size_t),
+                  pageSize());
+  char *end{alignDown(reinterpret_cast<char *>(getFooter(block)), pageSize())};
+  return end > start ? end - start : 0;
+}
+
+/** Blocks enter the lists stamped with the current decay tick **/
+void insertFree(Block *block) {
+  size_t fl, sl;
+  mappingInsert(block->size, fl, sl);
+  block->epoch = decay_epoch;
+
+  block->prev = nullptr;
+  block->next = free_lists[fl][sl];
+  if (block->next != nullptr) {
+    block->next->prev = block;
+  }
+
+  free_lists[fl][sl] = block;
+  fl_bitmap |= uint64_t{1} << fl;
+  sl_bitmap[fl] |= uint32_t{1} << sl;
+  free_bytes[fl] += block->size;
+}
+
+void removeFree(Block *block) {
+  size_t fl, sl;
+  mappingInsert(block->size, fl, sl);
+
+  if (block->prev != nullptr) {
+    block->prev->next = block->next;
+  } else {
+    free_lists[fl][sl] = block->next;
+  }
+
+  if (block->next != nullptr) {
+    block->next->prev = block->prev;
+  }
+  free_bytes[fl] -= block->size;
+
+  if (free_lists[fl][sl] == nullptr) {
+    sl_bitmap[fl] &= ~(uint32_t{1} << sl);
+    if (sl_bitmap[fl] == 0) {
+      fl_bitmap &= ~(uint64_t{1} << fl);
+    }
+  }
+}
+
+/** Bytes of a purged block given back to the OS, kept in the first word
+ * of its payload. All of its run, or only what merged neighbours brought. **/
+size_t &purgedBytes(Block *block) {
+  return *static_cast<size_t *>(getPayload(block));
+}
+
+/** Purged pages count as resident again once the block is reused **/
+void unpurge(Block *block) {
+  if (!block->purged)
+    return;
+
+  purged_size.fetch_sub(purgedBytes(block), std::memory_order_relaxed);
+  block->purged = false;
+}
+
+/** Find and unlink a free block of at least size bytes in O(1) **/
+Block *findBlock(size_t size) {
+  size_t fl, sl;
+  mappingSearch(size, fl, sl);
+  if (fl >= FL_INDEX_COUNT)
+    return nullptr;
+
+  uint32_t sl_map{sl_bitmap[fl] & (~uint32_t{0} << sl)};
+  if (sl_map == 0) {
+    // No block in this first level, look for the next non empty one
+    uint64_t fl_map{fl_bitmap & (~uint64_t{0} << (fl + 1))};
+    if (fl_map == 0)
+      return nullptr;
+
+    fl = ffs(fl_map);
+    sl_map = sl_bitmap[fl];
+  }
+
+  sl = ffs(sl_map);
+  Block *block{free_lists[fl][sl]};
+  removeFree(block);
+
+  return block;
+}
+
+/** Hand pages to the OS, MADV_FREE lets the kernel reclaim them lazily
+ * and falls back to MADV_DONTNEED where unsupported **/
+bool releasePages(char *start, size_t length) {
+  int result{-1};
+#ifdef MADV_FREE
+  if (purge_lazy.load(std::memory_order_relaxed)) {
+    result = madvise(start, length, MADV_FREE);
+  }
+#endif
+  return result == 0 || madvise(start, length, MADV_DONTNEED) == 0;
+}
+
+/** Give back every whole page of a free block, pages merged in already
+ * purged are not counted twice. Returns the bytes newly purged. **/
+size_t purgeBlock(Block *block) {
+  char *start;
+  size_t length{purgeRun(block, start)};
+  size_t before{block->purged ? purgedBytes(block) : 0};
+  if (length == before || !releasePages(start, length))
+    return 0;
+
+  block->purged = true;
+  purgedBytes(block) = length;
+  purged_size.fetch_add(length - before, std::memory_order_relaxed);
+  return length - before;
+}
+
+/** Purge free blocks from min_size up that were freed at least min_age
+ * decay ticks ago, caller holds heap_mutex **/
+size_t purgeFree(size_t min_size, uint8_t min_age) {
+  size_t purged{};
+  uint64_t fl_map{fl_bitmap & (~uint64_t{0} << sizeClass(min_size))};
+  for (; fl_map != 0; fl_map &= fl_map - 1) {
+    size_t fl{ffs(fl_map)};
+    for (uint32_t sl_map{sl_bitmap[fl]}; sl_map != 0; sl_map &= sl_map - 1) {
+      for (Block *curr{free_lists[fl][ffs(sl_map)]}; curr != nullptr;
+           curr = curr->next) {
+        if (static_cast<uint8_t>(decay_epoch - curr->epoch) >= min_age) {
+          purged += purgeBlock(curr);
+        }
+      }
+    }
+  }
+
+  return purged;
+}
+
+/** removeFree for a neighbour being merged, its purged bytes carry over
+ * to the merged block **/
+void unlinkMerged(Block *block, size_t &purged) {
+  removeFree(block);
+  if (block->purged) {
+    purged += purgedBytes(block);
+    block->purged = false;
+  }
+}
+
+/** The merged block keeps what its parts had purged. The pages just freed
+ * stay resident until the whole block ages out in the decay, purging them
+ * right away would fault them back in on the next allocation. **/
+void keepPurged(Block *block, size_t purged) {
+  if (purged == 0)
+    return;
+
+  block->purged = true;
+  purgedBytes(block) = purged;
+}
+
+uint64_t nowMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Advance the decay clock, at most once per decay_ms. Blocks stamped
+ * before the previous tick have sat free for a whole period and are
+ * purged, ones reused sooner never are. Caller holds heap_mutex. **/
+void decay() {
+  size_t interval{decay_ms.load(std::memory_order_relaxed)};
+  uint64_t now{nowMs()};
+  if (now - decay_last.load(std::memory_order_relaxed) < interval)
+    return;
+
+  decay_last.store(now, std::memory_order_relaxed);
+  decay_epoch++;
+  purgeFree(PURGE_MIN_SIZE, interval == 0 ? 0 : 2);
+}
+
+/** Append a free block of at least size bytes after the tail, the heap
+ * grows by HEAP_GROWTH or more so most allocations never reach sbrk **/
+Block *extendHeap(size_t size) {
+  // Block, its epilogue and slack to align a new segment
+  size_t request{allocSize(size) + sizeof(Block) + ALIGNMENT};
+  if (request < HEAP_GROWTH) {
+    request = HEAP_GROWTH;
+  }
+
+  if (overLimit(request)) {
+    purgeFree(pageSize(), 0);
+    if (overLimit(request))
+      return nullptr;
+  }
+
+  char *mem{static_cast<char *>(requestFromOS(request))};
+  if (mem == nullptr)
+    return nullptr;
+  heap_size.fetch_add(request, std::memory_order_relaxed);
+  raisePeak(peak_mapped, memorySize());
+
+  Block *block{nullptr};
+  if (tail != nullptr && mem == heap_end) {
+    block = tail; // Contiguous, the old epilogue becomes the block header
+  } else {
+    block = reinterpret_cast<Block *>(alignUp(mem, ALIGNMENT));
+    block->prev_inuse = true; // Nothing before the start of a segment
+    if (tail != nullptr) {
+      tail->next = block;
+    } else {
+      head = block;
+    }
+  }
+
+  heap_end = mem + request;
+  block->size = alignDown(heap_end, ALIGNMENT) -
+                reinterpret_cast<char *>(block) - 2 * sizeof(Block);
+  block->inuse = false;
+  block->mmapped = false;
+  block->purged = false;
+
+  tail = nextBlock(block);
+  tail->size = 0;
+  tail->inuse = true;
+  tail->prev_inuse = false;
+  tail->mmapped = false;
+  tail->next = nullptr;
+
+  // A free block before the old epilogue grows with the heap
+  if (!block->prev_inuse) {
+    size_t purged{};
+    Block *prev{prevBlock(block)};
+    unlinkMerged(prev, purged);
+    prev->size += allocSize(block->size);
+    block = prev;
+    keepPurged(block, purged);
+  }
+
+  return block;
+}
+
+bool canCoalesce(Block *block) {
+  return !nextBlock(block)->inuse || !block->prev_inuse;
+}
+
+/** Merge block with its free neighbours, returns the merged block **/
+Block *coalesce(Block *block) {
+  size_t purged{};
+  Block *next{nextBlock(block)};
+  if (!next->inuse) {
+    unlinkMerged(next, purged);
+    block->size += allocSize(next->size);
+    coalesce_count[sizeClass(block->size)]++;
+  }
+
+  if (!block->prev_inuse) {
+    Block *prev{prevBlock(block)};
+    unlinkMerged(prev, purged);
+    prev->size += allocSize(block->size);
+    block = prev;
+    coalesce_count[sizeClass(block->size)]++;
+  }
+
+  keepPurged(block, purged);
+  return block;
+}
+
+/** Only split when the remainder can hold a header and a minimum payload **/
+bool canSplit(Block *block, size_t size) {
+  return block->size >= size + allocSize(ALIGNMENT);
+}
+
+Block *split(Block *block, size_t size) {
+  split_count[sizeClass(block->size)]++;
+  char *start;
+  size_t whole{purgeRun(block, start)};
+  size_t purged{block->purged ? purgedBytes(block) : 0};
+
+  Block *newBlock{reinterpret_cast<Block *>(
+      static_cast<char *>(getPayload(block)) + size)};
+  newBlock->size = block->size - allocSize(size);
+  newBlock->inuse = false;
+  newBlock->prev_inuse = true; // block is handed out by the caller
+  newBlock->mmapped = false;
+  newBlock->purged = false;
+  *getFooter(newBlock) = newBlock->size;
+  nextBlock(newBlock)->prev_inuse = false;
+
+  // A wholly purged block leaves a wholly purged remainder, only the part
+  // handed out is resident again. Which pages of a partly purged block
+  // were given back is not known, so all of them count as resident.
+  if (purged != 0 && purged == whole) {
+    size_t rest{purgeRun(newBlock, start)};
+    if (rest != 0) {
+      newBlock->purged = true;
+      purgedBytes(newBlock) = rest;
+    }
+    purged_size.fetch_sub(purged - rest, std::memory_order_relaxed);
+  } else if (purged != 0) {
+    purged_size.fetch_sub(purged, std::memory_order_relaxed);
+  }
+  block->purged = false;
+
+  block->size = size;
+  insertFree(newBlock);
+
+  return block;
+}
+
+/** Carve a block of size bytes out of the heap, caller holds heap_mutex **/
+Block *heapAlloc(size_t size) {
+  decay();
+  Block *block{findBlock(size)};
+
+  if (block == nullptr) {
+    block = extendHeap(size);
+    if (block == nullptr)
+      return nullptr;
+  }
+
+  if (canSplit(block, size)) {
+    block = split(block, size);
+  }
+  unpurge(block);
+
+  block->inuse = true;
+  nextBlock(block)->prev_inuse = true;
+
+  return block;
+}
+
+/** Give a block back to the heap, caller holds heap_mutex **/
+void heapFree(Block *block) {
+  block->inuse = false;
+  block->purged = false; // Its pages were in use
+
+  if (canCoalesce(block)) {
+    block = coalesce(block);
+  }
+
+  *getFooter(block) = block->size;
+  nextBlock(block)->prev_inuse = false;
+  insertFree(block);
+  decay();
+}
+
+/** Free a list of cached blocks, caller holds heap_mutex **/
+void heapFreeList(Block *list) {
+  while (list != nullptr) {
+    Block *next{list->next};
+    heapFree(list);
+    list = next;
+  }
+}
+
+void linkLarge(Block *block) {
+  block->prev = nullptr;
+  block->next = large_spans;
+  if (large_spans != nullptr) {
+    large_spans->prev = block;
+  }
+  large_spans = block;
+}
+
+void unlinkLarge(Block *block) {
+  if (block->prev != nullptr) {
+    block->prev->next = block->next;
+  } else {
+    large_spans = block->next;
+  }
+
+  if (block->next != nullptr) {
+    block->next->prev = block->prev;
+  }
+}
+
+/** A span starts at the page holding its header and ends with its payload **/
+char *spanBase(Block *block) {
+  return alignDown(reinterpret_cast<char *>(block), pageSize());
+}
+
+size_t spanLength(Block *block) {
+  return static_cast<char *>(getPayload(block)) + block->size -
+         spanBase(block);
+}
+
+/** Map a large object, the whole mapping past the header is usable **/
+Block *largeAlloc(size_t size, size_t alignment) {
+  size_t slack{alignment > ALIGNMENT ? alignment : 0};
+  size_t length{pageAlign(allocSize(size) + slack)};
+  if (!withinLimit(length))
+    return nullptr;
+
+  void *mem{mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)};
+  if (mem == MAP_FAILED)
+    return nullptr;
+
+  // Over-aligned spans give the pages around the payload back
+  char *start{static_cast<char *>(mem)};
+  char *payload{alignUp(start + sizeof(Block), alignment)};
+  Block *block{getHeader(payload)};
+  char *base{spanBase(block)};
+  char *end{alignUp(payload + size, pageSize())};
+  if (base != start) {
+    munmap(start, base - start);
+  }
+  if (end != start + length) {
+    munmap(end, start + length - end);
+  }
+
+  block->size = end - payload;
+  block->inuse = true;
+  block->prev_inuse = true;
+  block->mmapped = true;
+  block->owner = 0;
+
+  std::lock_guard<std::mutex> lock{large_mutex};
+  linkLarge(block);
+  large_size.fetch_add(end - base, std::memory_order_relaxed);
+  large_mapped[sizeClass(block->size)] += end - base;
+  raisePeak(peak_mapped, memorySize());
+
+  return block;
+}
+
+void largeFree(Block *block) {
+  char *base{spanBase(block)};
+  size_t length{spanLength(block)};
+
+  // A freed mapping bigger than the threshold was transient, serve that
+  // size from the heap from now on
+  size_t threshold{mmap_threshold.load(std::memory_order_relaxed)};
+  if (block->size > threshold && block->size <= DEFAULT_MMAP_THRESHOLD_MAX) {
+    mmap_threshold.store(block->size, std::memory_order_relaxed);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{large_mutex};
+    unlinkLarge(block);
+    large_size.fetch_sub(length, std::memory_order_relaxed);
+    large_mapped[sizeClass(block->size)] -= length;
+  }
+
+  munmap(base, length);
+}
+
+/** Resize the mapping in place when possible, the kernel moves it if not **/
+Block *largeRealloc(Block *block, size_t size) {
+  char *base{spanBase(block)};
+  size_t offset{static_cast<size_t>(reinterpret_cast<char *>(block) - base)};
+  size_t old_length{spanLength(block)};
+  size_t length{pageAlign(offset + allocSize(size))};
+  if (length == old_length)
+    return block;
+  if (length > old_length && !withinLimit(length - old_length))
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock{large_mutex};
+  unlinkLarge(block);
+  size_t old_class{sizeClass(block->size)};
+
+  void *mem{mremap(base, old_length, length, MREMAP_MAYMOVE)};
+  if (mem == MAP_FAILED) {
+    linkLarge(block);
+    return nullptr;
+  }
+
+  large_mapped[old_class] -= old_length;
+  block = reinterpret_cast<Block *>(static_cast<char *>(mem) + offset);
+  block->size = length - offset - sizeof(Block);
+  linkLarge(block);
+  large_size.fetch_add(length - old_length, std::memory_order_relaxed);
+  large_mapped[sizeClass(block->size)] += length;
+  raisePeak(peak_mapped, memorySize());
+
+  return block;
+}
+
+uint16_t cacheId(ThreadCache *cache) {
+  return static_cast<uint16_t>(cache - thread_caches + 1);
+}
+
+size_t cacheIndex(size_t size) { return size / ALIGNMENT - 1; }
+
+/** Runs at thread exit, hands everything cached to the heap **/
+void releaseThreadCache(void *arg) {
+  ThreadCache *cache{static_cast<ThreadCache *>(arg)};
+  thread_cache = nullptr; // Later frees in this thread take the locked path
+
+  {
+    std::lock_guard<std::mutex> lock{heap_mutex};
+    for (size_t i{}; i < CACHE_CLASS_COUNT; i++) {
+      heapFreeList(cache->bins[i]);
+      cache->bins[i] = nullptr;
+      cache->counts[i] = 0;
+    }
+    heapFreeList(
+        cache->remote_frees.exchange(nullptr, std::memory_order_acquire));
+  }
+
+  countLive(nullptr, cache->stats.pending);
+  cache->stats.pending = 0;
+
+  // A free racing with the release lands in the queue, the next owner of
+  // this slot drains it
+  cache->claimed.store(false, std::memory_order_release);
+}
+
+/** Claim a free cache slot on first use, nullptr if every slot is taken **/
+ThreadCache *getThreadCache() {
+  if (thread_cache_init)
+    return thread_cache;
+
+  thread_cache_init = true;
+  pthread_once(&thread_cache_once, [] {
+    pthread_key_create(&thread_cache_key, releaseThreadCache);
+  });
+
+  for (auto &cache : thread_caches) {
+    bool expected{false};
+    if (cache.claimed.compare_exchange_strong(expected, true,
+                                              std::memory_order_acquire)) {
+      thread_cache = &cache;
+      pthread_setspecific(thread_cache_key, &cache);
+      break;
+    }
+  }
+
+  return thread_cache;
+}
+
+void cachePush(ThreadCache *cache, Block *block) {
+  size_t index{cacheIndex(block->size)};
+  block->next = cache->bins[index];
+  cache->bins[index] = block;
+
+  if (++cache->counts[index] <= CACHE_BIN_LIMIT)
+    return;
+
+  // Surplus flows back to the shared heap, half a bin per lock
+  Block *surplus{cache->bins[index]};
+  Block *last{surplus};
+  for (uint32_t i{1}; i < CACHE_BIN_LIMIT / 2; i++) {
+    last = last->next;
+  }
+  cache->bins[index] = last->next;
+  cache->counts[index] -= CACHE_BIN_LIMIT / 2;
+  last->next = nullptr;
+
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  heapFreeList(surplus);
+}
+
+/** Frees absorbed by thread caches never reach heapFree, so they look at
+ * the clock every DECAY_CHECK_FREES and tick the decay when it is due and
+ * the heap lock is free. A process that stops calling the allocator
+ * altogether keeps its free pages until trim(). **/
+void cacheDecay(ThreadCache *cache) {
+  if (cache->decay_countdown-- != 0)
+    return;
+
+  cache->decay_countdown = DECAY_CHECK_FREES;
+  if (nowMs() - decay_last.load(std::memory_order_relaxed) <
+      decay_ms.load(std::memory_order_relaxed))
+    return;
+
+  std::unique_lock<std::mutex> lock{heap_mutex, std::try_to_lock};
+  if (lock.owns_lock()) {
+    decay();
+  }
+}
+
+/** Lock-free push onto the owner's queue, any thread may call it **/
+void remotePush(ThreadCache *cache, Block *block) {
+  Block *top{cache->remote_frees.load(std::memory_order_relaxed)};
+  do {
+    block->next = top;
+  } while (!cache->remote_frees.compare_exchange_weak(
+      top, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/** Only the owner pops, taking the whole queue at once **/
+void drainRemoteFrees(ThreadCache *cache) {
+  Block *list{cache->remote_frees.exchange(nullptr, std::memory_order_acquire)};
+  while (list != nullptr) {
+    Block *next{list->next};
+    cachePush(cache, list);
+    list = next;
+  }
+}
+
+Block *cachePop(ThreadCache *cache, size_t size) {
+  size_t index{cacheIndex(size)};
+  if (cache->bins[index] == nullptr) {
+    drainRemoteFrees(cache);
+  }
+
+  Block *block{cache->bins[index]};
+  if (block != nullptr) {
+    cache->bins[index] = block->next;
+    cache->counts[index]--;
+  }
+
+  return block;
+}
+
+/** Counts the block against the calling thread and hands out its payload **/
+void *allocated(Block *block) {
+  if (block == nullptr)
+    return nullptr;
+
+  countAlloc(getThreadCache(), block->size);
+  return getPayload(block);
+}
+
+/** Small blocks are served from the thread cache without taking the lock **/
+void *alloc(size_t size) {
+  if (size > MAX_REQUEST_SIZE)
+    return nullptr;
+
+  size = align(size < ALIGNMENT ? ALIGNMENT : size);
+
+  if (size >= mmap_threshold.load(std::memory_order_relaxed))
+    return allocated(largeAlloc(size, ALIGNMENT));
+
+  ThreadCache *cache{getThreadCache()};
+  if (cache != nullptr && size <= CACHE_MAX_SIZE) {
+    Block *block{cachePop(cache, size)};
+    if (block != nullptr) {
+      countAlloc(cache, block->size);
+      return getPayload(block);
+    }
+  }
+
+  Block *block{nullptr};
+  {
+    std::lock_guard<std::mutex> lock{heap_mutex};
+    block = heapAlloc(size);
+  }
+
+  if (block == nullptr) {
+    // Heap cannot grow, fall back to a mapping as glibc does
+    return allocated(largeAlloc(size, ALIGNMENT));
+  }
+
+  block->owner = cache != nullptr && block->size <= CACHE_MAX_SIZE
+                     ? cacheId(cache)
+                     : 0;
+  countAlloc(cache, block->size);
+
+  return getPayload(block);
+}
+
+/** Blocks go back to their owner's cache, remotely from other threads **/
+void free(void *ptr) {
+  if (ptr == nullptr)
+    return;
+
+  Block *block{getHeader(ptr)};
+  ThreadCache *cache{getThreadCache()};
+  countFree(cache, block->size);
+  if (block->mmapped) {
+    largeFree(block);
+    return;
+  }
+
+  if (block->owner != 0) {
+    ThreadCache *owner{&thread_caches[block->owner - 1]};
+    if (owner == cache) {
+      cachePush(owner, block);
+      cacheDecay(cache);
+      return;
+    }
+
+    if (owner->claimed.load(std::memory_order_acquire)) {
+      remotePush(owner, block);
+      if (cache != nullptr) {
+        cacheDecay(cache);
+      }
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  heapFree(block);
+}
+
+/** Give the tail of an inuse block back to the heap, caller holds
+ * heap_mutex **/
+void trimBlock(Block *block, size_t size) {
+  if (!canSplit(block, size))
+    return;
+
+  Block *rest{reinterpret_cast<Block *>(static_cast<char *>(getPayload(block)) +
+                                        size)};
+  rest->size = block->size - allocSize(size);
+  rest->inuse = true;
+  rest->prev_inuse = true;
+  rest->mmapped = false;
+  block->size = size;
+  heapFree(rest);
+}
+
+/** Grow an inuse block into its free physical successor, or into new
+ * heap space when it sits before the epilogue, caller holds heap_mutex **/
+bool growInPlace(Block *block, size_t size) {
+  Block *next{nextBlock(block)};
+  if (!next->inuse && block->size + allocSize(next->size) >= size) {
+    removeFree(next);
+  } else if (next == tail || (!next->inuse && nextBlock(next) == tail)) {
+    // Contiguous growth reuses the epilogue and merges a free next block
+    Block *grown{extendHeap(size - block->size)};
+    if (grown == nullptr)
+      return false;
+
+    if (grown != next) {
+      // The break moved, the new segment is not ours to take
+      *getFooter(grown) = grown->size;
+      insertFree(grown);
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  unpurge(next);
+  block->size += allocSize(next->size);
+  nextBlock(block)->prev_inuse = true;
+  trimBlock(block, size);
+
+  return true;
+}
+
+/** Heap blocks shrink and grow in place when their neighbours allow,
+ * copying is the last resort **/
+void *realloc(void *ptr, size_t size) {
+  if (ptr == nullptr)
+    return alloc(size);
+
+  if (size == 0) {
+    free(ptr);
+    return nullptr;
+  }
+
+  if (size > MAX_REQUEST_SIZE)
+    return nullptr; // ptr stays valid, as realloc requires
+
+  Block *block{getHeader(ptr)};
+  if (block->mmapped) {
+    size_t old_size{block->size};
+    Block *resized{largeRealloc(block, size)};
+    if (resized == nullptr)
+      return nullptr;
+
+    ThreadCache *cache{getThreadCache()};
+    countFree(cache, old_size);
+    countAlloc(cache, resized->size);
+    return getPayload(resized);
+  }
+
+  size_t old_size{block->size};
+  size_t needed{align(size < ALIGNMENT ? ALIGNMENT : size)};
+  if (needed <= old_size && !canSplit(block, needed))
+    return ptr;
+
+  bool resized{true};
+  {
+    std::lock_guard<std::mutex> lock{heap_mutex};
+    if (needed <= old_size) {
+      trimBlock(block, needed);
+    } else {
+      resized = growInPlace(block, needed);
+    }
+  }
+
+  if (resized) {
+    if (block->size > CACHE_MAX_SIZE) {
+      block->owner = 0; // Too big for a cache bin now
+    }
+    ThreadCache *cache{getThreadCache()};
+    countFree(cache, old_size);
+    countAlloc(cache, block->size);
+    return ptr;
+  }
+
+  void *newPtr{alloc(size)};
+  if (newPtr == nullptr)
+    return nullptr;
+
+  std::memcpy(newPtr, ptr, block->size);
+  free(ptr);
+
+  return newPtr;
+}
+
+/** Fresh mappings are zero filled by the kernel, only heap blocks need it **/
+void *calloc(size_t count, size_t size) {
+  size_t total{};
+  if (__builtin_mul_overflow(count, size, &total))
+    return nullptr;
+
+  void *ptr{alloc(total)};
+  if (ptr != nullptr && !getHeader(ptr)->mmapped) {
+    std::memset(ptr, 0, total);
+  }
+
+  return ptr;
+}
+
+/** Over-allocate from the heap, then free what lies around the aligned
+ * payload **/
+void *alignedAlloc(size_t alignment, size_t size) {
+  if (alignment <= ALIGNMENT)
+    return alloc(size);
+
+  if (alignment > MAX_REQUEST_SIZE || size > MAX_REQUEST_SIZE - alignment)
+    return nullptr;
+
+  size = align(size < ALIGNMENT ? ALIGNMENT : size);
+  if (size + alignment >= mmap_threshold.load(std::memory_order_relaxed))
+    return allocated(largeAlloc(size, alignment));
+
+  std::unique_lock<std::mutex> lock{heap_mutex};
+  Block *block{heapAlloc(size + alignment + allocSize(ALIGNMENT))};
+  if (block == nullptr) {
+    // Heap cannot grow, fall back to a mapping as alloc does
+    lock.unlock();
+    return allocated(largeAlloc(size, alignment));
+  }
+
+  char *payload{static_cast<char *>(getPayload(block))};
+  char *aligned{alignUp(payload, alignment)};
+  if (aligned != payload) {
+    // The gap in front must fit a block of its own
+    if (static_cast<size_t>(aligned - payload) < allocSize(ALIGNMENT)) {
+      aligned = alignUp(payload + allocSize(ALIGNMENT), alignment);
+    }
+
+    Block *front{block};
+    block = getHeader(aligned);
+    block->size = front->size - (aligned - payload);
+    block->inuse = true;
+    block->mmapped = false;
+    front->size = aligned - payload - sizeof(Block);
+    heapFree(front);
+  }
+
+  trimBlock(block, size);
+  block->owner = 0;
+  lock.unlock();
+
+  return allocated(block);
+}
+
+size_t usableSize(void *ptr) {
+  return ptr != nullptr ? getHeader(ptr)->size : 0;
+}
+
+void forkPrepare() {
+  large_mutex.lock();
+  heap_mutex.lock();
+}
+
+void forkParent() {
+  heap_mutex.unlock();
+  large_mutex.unlock();
+}
+
+void forkChild() {
+  heap_mutex.unlock();
+  large_mutex.unlock();
+}
+
+/** Return the calling thread's cached and remotely freed blocks to the heap **/
+void flushThreadCache() {
+  ThreadCache *cache{getThreadCache()};
+  if (cache == nullptr)
+    return;
+
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  for (size_t i{}; i < CACHE_CLASS_COUNT; i++) {
+    heapFreeList(cache->bins[i]);
+    cache->bins[i] = nullptr;
+    cache->counts[i] = 0;
+  }
+  heapFreeList(
+      cache->remote_frees.exchange(nullptr, std::memory_order_acquire));
+}
+
+/** Purge every free page run in the heap now **/
+size_t trim() {
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  return purgeFree(pageSize(), 0);
+}
+
+size_t largestFree() {
+  if (fl_bitmap == 0)
+    return 0;
+
+  size_t fl{fls(fl_bitmap)};
+  size_t largest{};
+  for (Block *curr{free_lists[fl][fls(sl_bitmap[fl])]}; curr != nullptr;
+       curr = curr->next) {
+    largest = curr->size > largest ? curr->size : largest;
+  }
+
+  return largest;
+}
+
+void readStats(Stats &stats) {
+  stats = Stats{};
+  {
+    std::lock_guard<std::mutex> lock{heap_mutex};
+    for (size_t i{}; i < FL_INDEX_COUNT; i++) {
+      stats.classes[i].free = free_bytes[i];
+      stats.classes[i].splits = split_count[i];
+      stats.classes[i].coalesces = coalesce_count[i];
+      stats.free += free_bytes[i];
+    }
+    stats.largest_free = largestFree();
+  }
+  {
+    std::lock_guard<std::mutex> lock{large_mutex};
+    for (size_t i{}; i < FL_INDEX_COUNT; i++) {
+      stats.classes[i].mapped = large_mapped[i];
+    }
+  }
+
+  for (size_t i{}; i < FL_INDEX_COUNT; i++) {
+    ClassStats &cls{stats.classes[i]};
+    cls.min_size = i == 0 ? 0 : size_t{1} << (i + FL_INDEX_SHIFT - 1);
+    cls.allocated = allocatedBytes(i);
+    cls.requests = shared_stats.requests[i].load(std::memory_order_relaxed);
+    for (auto &cache : thread_caches) {
+      cls.requests += cache.stats.requests[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  // Bins belong to their threads, the counts are only sampled
+  for (auto &cache : thread_caches) {
+    for (size_t i{}; i < CACHE_CLASS_COUNT; i++) {
+      stats.cached += __atomic_load_n(&cache.counts[i], __ATOMIC_RELAXED) *
+                      (i + 1) * ALIGNMENT;
+    }
+  }
+
+  stats.allocated = allocatedBytes();
+  stats.heap_mapped = heap_size.load(std::memory_order_relaxed);
+  stats.large_mapped = large_size.load(std::memory_order_relaxed);
+  stats.purged = purged_size.load(std::memory_order_relaxed);
+  stats.resident = stats.heap_mapped + stats.large_mapped - stats.purged;
+  raisePeak(peak_allocated, stats.allocated);
+  raisePeak(peak_mapped, stats.heap_mapped + stats.large_mapped);
+  stats.peak_allocated = peak_allocated.load(std::memory_order_relaxed);
+  stats.peak_mapped = peak_mapped.load(std::memory_order_relaxed);
+  stats.fragmentation =
+      stats.free == 0 ? 0.0 : 1.0 - double(stats.largest_free) / stats.free;
+}
+
+/** Walk blocks in address order, epilogues link to the next segment **/
+void printMemory() {
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  Block *curr{head};
+  while (curr != nullptr) {
+    if (curr->size == 0) {
+      curr = curr->next;
+      continue;
+    }
+
+    std::cout << '[' << curr->size << ", " << curr->inuse << "] -> ";
+    curr = nextBlock(curr);
+  }
+
+  std::cout << "nullptr\n";
+}
+
+int blocksAvailable() {
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  Block *curr{head};
+  int n_blocks{};
+  while (curr != nullptr) {
+    if (curr->size == 0) {
+      curr = curr->next;
+      continue;
+    }
+
+    n_blocks++;
+    curr = nextBlock(curr);
+  }
+
+  return n_blocks;
+}
+
+/** Debug helper that hands the whole heap back with brk and unmaps every
+ * large object, an Arena is the region allocator for real use **/
+void resetHeap() {
+  {
+    std::lock_guard<std::mutex> lock{large_mutex};
+    while (large_spans != nullptr) {
+      Block *next{large_spans->next};
+      munmap(spanBase(large_spans), spanLength(large_spans));
+      large_spans = next;
+    }
+    large_size = 0;
+    for (auto &mapped : large_mapped) {
+      mapped = 0;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock{heap_mutex};
+  if (head == nullptr)
+    return; // already reset
+
+  brk(head);
+
+  head = nullptr;
+  tail = nullptr;
+  heap_end = nullptr;
+  heap_size = 0;
+  fl_bitmap = 0;
+  for (auto &bitmap : sl_bitmap) {
+    bitmap = 0;
+  }
+  for (auto &lists : free_lists) {
+    for (auto &list : lists) {
+      list = nullptr;
+    }
+  }
+  for (size_t i{}; i < FL_INDEX_COUNT; i++) {
+    free_bytes[i] = 0;
+    split_count[i] = 0;
+    coalesce_count[i] = 0;
+    shared_stats.allocated[i] = 0;
+    shared_stats.requests[i] = 0;
+  }
+  live_bytes = 0;
+  peak_allocated = 0;
+  peak_mapped = 0;
+  purged_size = 0;
+  decay_epoch = 0;
+  decay_last = 0;
+  for (auto &cache : thread_caches) {
+    for (size_t i{}; i < CACHE_CLASS_COUNT; i++) {
+      cache.bins[i] = nullptr;
+      cache.counts[i] = 0;
+    }
+    cache.remote_frees.store(nullptr, std::memory_order_relaxed);
+    for (size_t i{}; i < FL_INDEX_COUNT; i++) {
+      cache.stats.allocated[i] = 0;
+      cache.stats.requests[i] = 0;
+    }
+    cache.stats.pending = 0;
+  }
+  return;
+}
+} // namespace memalloc
@@ -0,0 +1,110 @@
+#pragma once
+
+/** Includes **/
+#include <cstddef>
+#include <cstdint>
+
+namespace memalloc {
+
+struct Block {
+  size_t size;
+  bool inuse;
+  bool prev_inuse; // Physical predecessor state, its footer is valid if false
+  bool mmapped;    // Large object with a mapping of its own
+  uint16_t owner;  // Thread cache id the block returns to, 0 for the heap
+  bool purged;     // Free block that gave pages back, counted in its payload
+  uint8_t epoch;   // Decay tick the block was last freed in
+
+  Block *prev{nullptr}; // Free list links, only valid while !inuse
+  Block *next{nullptr}; // Epilogues use next to chain heap segments
+};
+
+/** Allocation interface, the C ABI in malloc.cpp forwards to these **/
+void *alloc(size_t size);
+void free(void *ptr);
+void *realloc(void *ptr, size_t size);
+void *calloc(size_t count, size_t size);
+void *alignedAlloc(size_t alignment, size_t size);
+size_t usableSize(void *ptr);
+
+/** Header and payload are found from each other by pointer arithmetic **/
+Block *getHeader(void *ptr);
+void *getPayload(Block *block);
+Block *nextBlock(Block *block);
+
+/** Return the calling thread's cached and remotely freed blocks **/
+void flushThreadCache();
+
+/** Hold every allocator lock across fork() so the child inherits a
+ * consistent heap **/
+void forkPrepare();
+void forkParent();
+void forkChild();
+
+size_t memorySize();
+size_t mmapThreshold();
+void setMmapThreshold(size_t threshold);
+
+/** Whole pages inside free heap blocks go back to the OS with madvise once
+ * they stayed free for the decay time, checked as the allocator is called.
+ * trim() gives them back at once, idle processes have to call it. **/
+size_t trim();
+size_t decayMs();
+void setDecayMs(size_t ms); // 0 purges on every heap operation
+bool purgeLazy();
+void setPurgeLazy(bool lazy); // MADV_FREE rather than MADV_DONTNEED
+
+/** Mapped bytes less what was purged, allocations fail rather than grow
+ * past the limit, 0 for none **/
+size_t residentSize();
+size_t rssLimit();
+void setRssLimit(size_t limit);
+
+/** Statistics are kept per first level TLSF class, each covers a power of
+ * two range of block sizes starting at min_size **/
+constexpr size_t SIZE_CLASS_COUNT{41};
+
+struct ClassStats {
+  size_t min_size;
+  int64_t allocated; // Payload bytes handed out, summed over threads
+  uint64_t requests; // Allocations served, the size histogram
+  size_t free;       // Bytes in the heap free lists
+  size_t mapped;     // Bytes mapped for large objects
+  uint64_t splits;
+  uint64_t coalesces;
+};
+
+struct Stats {
+  size_t allocated;      // Payload bytes in use by the program
+  size_t cached;         // Bytes held in thread caches
+  size_t free;           // Bytes in the heap free lists
+  size_t heap_mapped;    // Bytes obtained through sbrk
+  size_t large_mapped;   // Bytes mapped for large objects
+  size_t purged;         // Free heap bytes given back with madvise
+  size_t resident;       // heap_mapped + large_mapped - purged
+  size_t peak_allocated; // High-water marks
+  size_t peak_mapped;
+  size_t largest_free;  // Largest heap free block
+  double fragmentation; // 1 - largest_free / free, 0 for an empty heap
+  ClassStats classes[SIZE_CLASS_COUNT];
+};
+
+/** Per-thread counters are merged here, the heap is only locked to copy
+ * its free list totals **/
+void readStats(Stats &stats);
+
+/** Named statistics and options, see stats.cpp for the names. Returns 0 or
+ * an errno value like jemalloc's mallctl **/
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+            size_t newlen);
+
+/** Statistics as a JSON object, returns the length it needs and writes
+ * at most size - 1 characters and a terminating nul **/
+size_t statsJson(char *buffer, size_t size);
+void dumpStats(int fd);
+
+void printMemory();
+int blocksAvailable();
+void resetHeap();
+
+} // namespace memalloc
@@ -0,0 +1,194 @@
+/** Includes **/
+#include "pool.hpp"
+#include "memalloc.hpp"
+
+#include <unistd.h>
+
+namespace memalloc {
+
+namespace {
+
+constexpr size_t MIN_SLAB_SLOTS{8}; // Large slots get a larger slab
+
+size_t alignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+size_t pageSize() {
+  static const size_t page_size{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+  return page_size;
+}
+
+} // namespace
+
+/** Slabs are a page unless that holds fewer than MIN_SLAB_SLOTS slots,
+ * then the next power of two that does **/
+SlabPool::SlabPool(size_t size, size_t alignment) {
+  alignment = alignment < alignof(Slot) ? alignof(Slot) : alignment;
+  slot_size = alignUp(size < sizeof(Slot) ? sizeof(Slot) : size, alignment);
+  slots_offset = alignUp(sizeof(Slab), alignment);
+
+  slab_size = pageSize();
+  while (slab_size < slots_offset + MIN_SLAB_SLOTS * slot_size) {
+    slab_size *= 2;
+  }
+
+  slab_slots = (slab_size - slots_offset) / slot_size;
+  slab_slots = slab_slots < MAX_SLAB_SLOTS ? slab_slots : MAX_SLAB_SLOTS;
+  slot_reciprocal = ((uint64_t{1} << 32) + slot_size - 1) / slot_size;
+}
+
+SlabPool::~SlabPool() {
+  for (Slab *list : {partial, full}) {
+    while (list != nullptr) {
+      Slab *next{list->next};
+      memalloc::free(list);
+      list = next;
+    }
+  }
+}
+
+void SlabPool::link(Slab *&list, Slab *slab) {
+  slab->prev = nullptr;
+  slab->next = list;
+  if (list != nullptr) {
+    list->prev = slab;
+  }
+  list = slab;
+}
+
+void SlabPool::unlink(Slab *&list, Slab *slab) {
+  if (slab->prev != nullptr) {
+    slab->prev->next = slab->next;
+  } else {
+    list = slab->next;
+  }
+
+  if (slab->next != nullptr) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+/** Free list in address order so a fresh slab hands out adjacent slots **/
+SlabPool::Slab *SlabPool::newSlab() {
+  Slab *slab{static_cast<Slab *>(alignedAlloc(slab_size, slab_size))};
+  if (slab == nullptr)
+    return nullptr;
+
+  slab->used = 0;
+  slab->in_full = false;
+  for (uint64_t &word : slab->occupancy) {
+    word = 0;
+  }
+
+  Slot *next{nullptr};
+  for (size_t i{slab_slots}; i-- > 0;) {
+    Slot *slot{reinterpret_cast<Slot *>(firstSlot(slab) + i * slot_size)};
+    slot->next = next;
+    next = slot;
+  }
+  slab->free_slots = next;
+
+  return slab;
+}
+
+/** Takes every free slot of the first partial slab at once, the slab is
+ * then full as far as its bitmap and the lists go **/
+void *SlabPool::allocateSlow() {
+  Slab *slab{partial};
+  if (slab == nullptr) {
+    slab = newSlab();
+    if (slab == nullptr)
+      return nullptr;
+  } else {
+    unlink(partial, slab);
+  }
+  link(full, slab);
+  slab->in_full = true;
+
+  cached = slab->free_slots;
+  cached_count = slab_slots - slab->used;
+  slab->free_slots = nullptr;
+  slab->used = static_cast<uint32_t>(slab_slots);
+  for (size_t w{}; w < OCCUPANCY_WORDS; w++) {
+    size_t bits{slab_slots > w * 64 ? slab_slots - w * 64 : 0};
+    slab->occupancy[w] = bits >= 64 ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
+  }
+
+  return allocate();
+}
+
+/** Returns the cached slots past the first keep to their slabs. A slab
+ * that regains a slot moves to the partial list, an empty slab goes back
+ * to the allocator unless it is the last one with free slots. **/
+void SlabPool::flush(size_t keep) {
+  Slot **link_to{&cached};
+  for (size_t i{}; i < keep && *link_to != nullptr; i++) {
+    link_to = &(*link_to)->next;
+  }
+  Slot *slot{*link_to};
+  *link_to = nullptr;
+  cached_count = keep < cached_count ? keep : cached_count;
+
+  while (slot != nullptr) {
+    Slot *next{slot->next};
+    Slab *slab{slabOf(slot)};
+    slot->next = slab->free_slots;
+    slab->free_slots = slot;
+    setOccupied(slab, slot, false);
+    if (slab->in_full) {
+      unlink(full, slab);
+      link(partial, slab);
+      slab->in_full = false;
+    }
+    if (--slab->used == 0 && (slab != partial || slab->next != nullptr)) {
+      unlink(partial, slab);
+      memalloc::free(slab);
+    }
+    slot = next;
+  }
+}
+
+PoolResource::~PoolResource() {
+  for (size_t i{}; i < POOL_COUNT; i++) {
+    if (constructed & (uint32_t{1} << i)) {
+      reinterpret_cast<SlabPool *>(pools[i])->~SlabPool();
+    }
+  }
+}
+
+/** nullptr when the request does not fit a pool **/
+SlabPool *PoolResource::pool(size_t bytes, size_t alignment) {
+  if (bytes > MAX_POOLED_SIZE || alignment > POOL_GRANULE)
+    return nullptr;
+
+  size_t index{bytes == 0 ? 0 : (bytes - 1) / POOL_GRANULE};
+  SlabPool *pool{reinterpret_cast<SlabPool *>(pools[index])};
+  if (!(constructed & (uint32_t{1} << index))) {
+    new (pool) SlabPool{(index + 1) * POOL_GRANULE, POOL_GRANULE};
+    constructed |= uint32_t{1} << index;
+  }
+
+  return pool;
+}
+
+void *PoolResource::do_allocate(size_t bytes, size_t alignment) {
+  SlabPool *slabs{pool(bytes, alignment)};
+  void *ptr{slabs != nullptr ? slabs->allocate()
+                             : alignedAlloc(alignment, bytes)};
+  if (ptr == nullptr)
+    throw std::bad_alloc{};
+
+  return ptr;
+}
+
+void PoolResource::do_deallocate(void *ptr, size_t bytes, size_t alignment) {
+  SlabPool *slabs{pool(bytes, alignment)};
+  if (slabs != nullptr) {
+    slabs->deallocate(ptr);
+  } else {
+    memalloc::free(ptr);
+  }
+}
+
+} // namespace memalloc
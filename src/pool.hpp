@@ -0,0 +1,237 @@
+#pragma once
+
+/** Includes **/
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace memalloc {
+
+/** Fixed size slots carved from slabs obtained with alignedAlloc. Slabs are
+ * aligned to their size so a slot finds its slab header by masking its
+ * address, free slots hold the free list link and live slots carry no
+ * header at all. A LIFO list of free slots sits in front of the slabs,
+ * filled a whole slab at a time and flushed back half at a time, so the
+ * fast paths never touch a slab. Not thread safe, like
+ * unsynchronized_pool_resource. **/
+class SlabPool {
+public:
+  static constexpr size_t MAX_SLAB_SLOTS{512};
+
+  explicit SlabPool(size_t size,
+                    size_t alignment = alignof(std::max_align_t));
+  ~SlabPool(); // Releases every slab, live slots included
+
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  /** nullptr when no slab can be obtained **/
+  void *allocate() {
+    Slot *slot{cached};
+    if (slot == nullptr)
+      return allocateSlow();
+
+    cached = slot->next;
+    cached_count--;
+    return slot;
+  }
+
+  void deallocate(void *ptr) {
+    Slot *slot{static_cast<Slot *>(ptr)};
+    slot->next = cached;
+    cached = slot;
+    if (++cached_count > 2 * slab_slots) {
+      flush(slab_slots);
+    }
+  }
+
+  /** Calls f with every live slot, slab by slab in bitmap order. Cached
+   * slots go back to their slabs first so the bitmaps are exact. **/
+  template <typename F> void forEach(F &&f) {
+    flush(0);
+    for (Slab *list : {partial, full}) {
+      for (Slab *slab{list}; slab != nullptr; slab = slab->next) {
+        for (size_t w{}; w < OCCUPANCY_WORDS; w++) {
+          for (uint64_t bits{slab->occupancy[w]}; bits != 0;
+               bits &= bits - 1) {
+            size_t index{w * 64 + __builtin_ctzll(bits)};
+            f(firstSlot(slab) + index * slot_size);
+          }
+        }
+      }
+    }
+  }
+
+  size_t slotSize() const { return slot_size; }
+  size_t slabSize() const { return slab_size; }
+
+private:
+  static constexpr size_t OCCUPANCY_WORDS{MAX_SLAB_SLOTS / 64};
+
+  struct Slot {
+    Slot *next;
+  };
+
+  struct Slab {
+    Slab *prev;
+    Slab *next;
+    Slot *free_slots;
+    uint32_t used;
+    bool in_full; // Linked in full rather than partial
+    uint64_t occupancy[OCCUPANCY_WORDS]; // Bit per slot, set while live
+  };
+
+  Slab *slabOf(void *ptr) const {
+    return reinterpret_cast<Slab *>(reinterpret_cast<uintptr_t>(ptr) &
+                                    ~(slab_size - 1));
+  }
+
+  char *firstSlot(Slab *slab) const {
+    return reinterpret_cast<char *>(slab) + slots_offset;
+  }
+
+  /** offset is a multiple of slot_size below 2^32, so multiplying by the
+   * rounded up reciprocal divides exactly **/
+  void setOccupied(Slab *slab, Slot *slot, bool live) {
+    uint64_t offset{static_cast<uint64_t>(reinterpret_cast<char *>(slot) -
+                                          firstSlot(slab))};
+    size_t index{static_cast<size_t>((offset * slot_reciprocal) >> 32)};
+    uint64_t bit{uint64_t{1} << (index % 64)};
+    if (live) {
+      slab->occupancy[index / 64] |= bit;
+    } else {
+      slab->occupancy[index / 64] &= ~bit;
+    }
+  }
+
+  void *allocateSlow();
+  void flush(size_t keep);
+  Slab *newSlab();
+  void link(Slab *&list, Slab *slab);
+  void unlink(Slab *&list, Slab *slab);
+
+  size_t slot_size;
+  size_t slab_size;
+  size_t slab_slots;   // Slots per slab
+  size_t slots_offset; // From the slab header to its first slot
+  uint64_t slot_reciprocal;
+
+  Slab *partial{nullptr}; // Slabs with free slots, the head refills cached
+  Slab *full{nullptr};    // Includes slabs whose free slots are all cached
+
+  Slot *cached{nullptr}; // Free slots counted as used by their slabs
+  size_t cached_count{};
+};
+
+/** Typed pool, objects still alive when the pool goes away are destroyed
+ * with it **/
+template <typename T> class Pool {
+public:
+  Pool() : slabs{sizeof(T), alignof(T)} {}
+
+  ~Pool() {
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      slabs.forEach([](char *ptr) { reinterpret_cast<T *>(ptr)->~T(); });
+    }
+  }
+
+  /** nullptr when out of memory, exceptions from T's constructor
+   * propagate and leave the slot free **/
+  template <typename... Args> T *create(Args &&...args) {
+    void *ptr{slabs.allocate()};
+    if (ptr == nullptr)
+      return nullptr;
+
+    if constexpr (std::is_nothrow_constructible_v<T, Args...>) {
+      return new (ptr) T(std::forward<Args>(args)...);
+    } else {
+      try {
+        return new (ptr) T(std::forward<Args>(args)...);
+      } catch (...) {
+        slabs.deallocate(ptr);
+        throw;
+      }
+    }
+  }
+
+  void destroy(T *object) {
+    object->~T();
+    slabs.deallocate(object);
+  }
+
+private:
+  SlabPool slabs;
+};
+
+/** Memory resource with one SlabPool per 16 byte size class up to
+ * MAX_POOLED_SIZE, larger or over-aligned requests go to alignedAlloc.
+ * Pools are set up on first use. **/
+class PoolResource final : public std::pmr::memory_resource {
+public:
+  static constexpr size_t POOL_GRANULE{16};
+  static constexpr size_t MAX_POOLED_SIZE{512};
+
+  PoolResource() = default;
+  ~PoolResource() override;
+
+  PoolResource(const PoolResource &) = delete;
+  PoolResource &operator=(const PoolResource &) = delete;
+
+private:
+  static constexpr size_t POOL_COUNT{MAX_POOLED_SIZE / POOL_GRANULE};
+
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *ptr, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  SlabPool *pool(size_t bytes, size_t alignment);
+
+  alignas(SlabPool) unsigned char pools[POOL_COUNT][sizeof(SlabPool)];
+  uint32_t constructed{}; // Bit per pool placed in pools
+  static_assert(POOL_COUNT <= 32, "One constructed bit per pool");
+};
+
+/** Standard allocator over a PoolResource, for containers that take an
+ * allocator type rather than a std::pmr::polymorphic_allocator. Node
+ * based containers allocate one node at a time and land in a slab pool. **/
+template <typename T> class PoolAllocator {
+public:
+  using value_type = T;
+
+  explicit PoolAllocator(PoolResource &resource) : resource{&resource} {}
+
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U> &other) : resource{other.resource} {}
+
+  T *allocate(size_t n) {
+    if (n > SIZE_MAX / sizeof(T))
+      throw std::bad_array_new_length{};
+
+    return static_cast<T *>(resource->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, size_t n) {
+    resource->deallocate(ptr, n * sizeof(T), alignof(T));
+  }
+
+  template <typename U> bool operator==(const PoolAllocator<U> &other) const {
+    return resource == other.resource;
+  }
+
+  template <typename U> bool operator!=(const PoolAllocator<U> &other) const {
+    return resource != other.resource;
+  }
+
+private:
+  template <typename U> friend class PoolAllocator;
+
+  PoolResource *resource;
+};
+
+} // namespace memalloc
@@ -0,0 +1,257 @@
+/** Includes **/
+#include "memalloc.hpp"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+/** Named statistics over readStats, in the spirit of jemalloc's mallctl.
+ * Nothing here allocates so it stays usable from inside libmemalloc.so.
+ *
+ *   stats.allocated, stats.cached, stats.free, stats.mapped,
+ *   stats.heap.mapped, stats.large.mapped, stats.purged,
+ *   stats.resident, stats.peak.allocated, stats.peak.mapped,
+ *   stats.largest_free                                       size_t
+ *   stats.fragmentation                                      double
+ *   stats.classes                                            size_t
+ *   stats.class.<i>.{size,free,mapped}                       size_t
+ *   stats.class.<i>.allocated                                int64_t
+ *   stats.class.<i>.{requests,splits,coalesces}              uint64_t
+ *   stats.json                          char[], *oldlenp is the buffer size
+ *   opt.mmap_threshold, opt.decay_ms, opt.rss_limit size_t, read and write
+ *   opt.purge_lazy                                    bool, read and write
+ *   thread.tcache.flush                                    no value, action
+ *   heap.trim                       action, reads the bytes purged (size_t)
+ **/
+
+namespace memalloc {
+
+namespace {
+
+/** Copy a value out, the caller's length has to match exactly **/
+template <typename T>
+int readValue(const T &value, void *oldp, size_t *oldlenp) {
+  if (oldp == nullptr || oldlenp == nullptr)
+    return 0;
+
+  if (*oldlenp != sizeof(T)) {
+    *oldlenp = sizeof(T);
+    return EINVAL;
+  }
+
+  std::memcpy(oldp, &value, sizeof(T));
+  return 0;
+}
+
+template <typename T>
+int readOnly(const T &value, void *oldp, size_t *oldlenp, void *newp) {
+  if (newp != nullptr)
+    return EPERM;
+
+  return readValue(value, oldp, oldlenp);
+}
+
+/** Options read their old value and then take the new one, if any **/
+template <typename T>
+int readWrite(T (*get)(), void (*set)(T), void *oldp, size_t *oldlenp,
+              void *newp, size_t newlen) {
+  int error{readValue(get(), oldp, oldlenp)};
+  if (error != 0 || newp == nullptr)
+    return error;
+  if (newlen != sizeof(T))
+    return EINVAL;
+
+  T value;
+  std::memcpy(&value, newp, sizeof(T));
+  set(value);
+  return 0;
+}
+
+/** "stats.class.<i>.<field>" **/
+int classCtl(const char *name, const Stats &stats, void *oldp,
+             size_t *oldlenp, void *newp) {
+  char *field{};
+  unsigned long index{std::strtoul(name, &field, 10)};
+  if (field == name || *field != '.' || index >= SIZE_CLASS_COUNT)
+    return ENOENT;
+
+  const ClassStats &cls{stats.classes[index]};
+  field++;
+  if (std::strcmp(field, "size") == 0)
+    return readOnly(cls.min_size, oldp, oldlenp, newp);
+  if (std::strcmp(field, "allocated") == 0)
+    return readOnly(cls.allocated, oldp, oldlenp, newp);
+  if (std::strcmp(field, "requests") == 0)
+    return readOnly(cls.requests, oldp, oldlenp, newp);
+  if (std::strcmp(field, "free") == 0)
+    return readOnly(cls.free, oldp, oldlenp, newp);
+  if (std::strcmp(field, "mapped") == 0)
+    return readOnly(cls.mapped, oldp, oldlenp, newp);
+  if (std::strcmp(field, "splits") == 0)
+    return readOnly(cls.splits, oldp, oldlenp, newp);
+  if (std::strcmp(field, "coalesces") == 0)
+    return readOnly(cls.coalesces, oldp, oldlenp, newp);
+
+  return ENOENT;
+}
+
+/** Appends with snprintf, keeps counting past the end of the buffer **/
+struct Writer {
+  char *buffer;
+  size_t size;
+  size_t length{};
+
+  void print(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    va_start(args, format);
+    char *out{length < size ? buffer + length : nullptr};
+    int n{std::vsnprintf(out, out != nullptr ? size - length : 0, format,
+                         args)};
+    va_end(args);
+    if (n > 0) {
+      length += n;
+    }
+  }
+};
+
+} // namespace
+
+size_t statsJson(char *buffer, size_t size) {
+  Stats stats;
+  readStats(stats);
+
+  Writer out{buffer, size};
+  out.print("{\"allocated\":%zu,\"cached\":%zu,\"free\":%zu,"
+            "\"heap_mapped\":%zu,\"large_mapped\":%zu,\"purged\":%zu,"
+            "\"resident\":%zu,\"peak_allocated\":%zu,\"peak_mapped\":%zu,"
+            "\"largest_free\":%zu,\"fragmentation\":%.4f,"
+            "\"mmap_threshold\":%zu,\"decay_ms\":%zu,\"rss_limit\":%zu,"
+            "\"classes\":[",
+            stats.allocated, stats.cached, stats.free, stats.heap_mapped,
+            stats.large_mapped, stats.purged, stats.resident,
+            stats.peak_allocated, stats.peak_mapped, stats.largest_free,
+            stats.fragmentation, mmapThreshold(), decayMs(), rssLimit());
+
+  // Only classes that saw any traffic, min_size identifies them
+  bool first{true};
+  for (const ClassStats &cls : stats.classes) {
+    if (cls.requests == 0 && cls.free == 0 && cls.mapped == 0)
+      continue;
+
+    out.print("%s{\"min_size\":%zu,\"allocated\":%" PRId64
+              ",\"requests\":%" PRIu64 ",\"free\":%zu,\"mapped\":%zu,"
+              "\"splits\":%" PRIu64 ",\"coalesces\":%" PRIu64 "}",
+              first ? "" : ",", cls.min_size, cls.allocated, cls.requests,
+              cls.free, cls.mapped, cls.splits, cls.coalesces);
+    first = false;
+  }
+  out.print("]}");
+
+  return out.length;
+}
+
+void dumpStats(int fd) {
+  char buffer[16 * 1024];
+  size_t length{statsJson(buffer, sizeof(buffer) - 1)};
+  length = length < sizeof(buffer) - 2 ? length : sizeof(buffer) - 2;
+  buffer[length++] = '\n';
+
+  size_t done{};
+  while (done < length) {
+    ssize_t n{write(fd, buffer + done, length - done)};
+    if (n <= 0)
+      break;
+    done += n;
+  }
+}
+
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+            size_t newlen) {
+  if (name == nullptr)
+    return EINVAL;
+
+  if (std::strcmp(name, "opt.mmap_threshold") == 0)
+    return readWrite(mmapThreshold, setMmapThreshold, oldp, oldlenp, newp,
+                     newlen);
+  if (std::strcmp(name, "opt.decay_ms") == 0)
+    return readWrite(decayMs, setDecayMs, oldp, oldlenp, newp, newlen);
+  if (std::strcmp(name, "opt.rss_limit") == 0)
+    return readWrite(rssLimit, setRssLimit, oldp, oldlenp, newp, newlen);
+  if (std::strcmp(name, "opt.purge_lazy") == 0)
+    return readWrite(purgeLazy, setPurgeLazy, oldp, oldlenp, newp, newlen);
+
+  if (std::strcmp(name, "heap.trim") == 0) {
+    if (newp != nullptr)
+      return EINVAL;
+
+    return readValue(trim(), oldp, oldlenp);
+  }
+
+  if (std::strcmp(name, "thread.tcache.flush") == 0) {
+    if (oldp != nullptr || newp != nullptr)
+      return EINVAL;
+
+    flushThreadCache();
+    return 0;
+  }
+
+  if (std::strcmp(name, "stats.json") == 0) {
+    if (newp != nullptr)
+      return EPERM;
+    if (oldp == nullptr || oldlenp == nullptr)
+      return EINVAL;
+
+    size_t length{statsJson(static_cast<char *>(oldp), *oldlenp)};
+    if (length >= *oldlenp) {
+      *oldlenp = length + 1;
+      return ENOMEM;
+    }
+
+    *oldlenp = length + 1;
+    return 0;
+  }
+
+  if (std::strncmp(name, "stats.", 6) != 0)
+    return ENOENT;
+
+  Stats stats;
+  readStats(stats);
+  const char *stat{name + 6};
+  if (std::strcmp(stat, "allocated") == 0)
+    return readOnly(stats.allocated, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "cached") == 0)
+    return readOnly(stats.cached, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "free") == 0)
+    return readOnly(stats.free, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "mapped") == 0)
+    return readOnly(stats.heap_mapped + stats.large_mapped, oldp, oldlenp,
+                    newp);
+  if (std::strcmp(stat, "heap.mapped") == 0)
+    return readOnly(stats.heap_mapped, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "large.mapped") == 0)
+    return readOnly(stats.large_mapped, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "purged") == 0)
+    return readOnly(stats.purged, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "resident") == 0)
+    return readOnly(stats.resident, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "peak.allocated") == 0)
+    return readOnly(stats.peak_allocated, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "peak.mapped") == 0)
+    return readOnly(stats.peak_mapped, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "largest_free") == 0)
+    return readOnly(stats.largest_free, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "fragmentation") == 0)
+    return readOnly(stats.fragmentation, oldp, oldlenp, newp);
+  if (std::strcmp(stat, "classes") == 0)
+    return readOnly(SIZE_CLASS_COUNT, oldp, oldlenp, newp);
+  if (std::strncmp(stat, "class.", 6) == 0)
+    return classCtl(stat + 6, stats, oldp, oldlenp, newp);
+
+  return ENOENT;
+}
+
+} // namespace memalloc
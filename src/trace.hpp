@@ -0,0 +1,78 @@
+#pragma once
+
+/** Includes **/
+#include <cstddef>
+#include <cstdint>
+
+/** Allocation trace format, recorded by libmemalloc.so when MEMALLOC_TRACE
+ * names a file and replayed by memalloc-bench.
+ *
+ * The file starts with MAGIC and VERSION, then one record per call: an op
+ * byte followed by LEB128 varints. Pointers are stored as seen by the
+ * recorded process and only serve to pair frees with their allocation.
+ *
+ *   Malloc  size result
+ *   Calloc  size result        (size is count * size)
+ *   Free    ptr
+ *   Realloc ptr size result
+ *   Aligned alignment size result
+ **/
+
+namespace memalloc {
+namespace trace {
+
+constexpr char MAGIC[4]{'M', 'A', 'T', 'R'};
+constexpr uint8_t VERSION{1};
+constexpr size_t MAX_RECORD_SIZE{1 + 3 * 10}; // Op and three varints
+
+enum class Op : uint8_t {
+  Malloc = 1,
+  Calloc = 2,
+  Free = 3,
+  Realloc = 4,
+  Aligned = 5,
+};
+
+inline size_t writeVarint(unsigned char *out, uint64_t value) {
+  size_t n{};
+  while (value >= 0x80) {
+    out[n++] = static_cast<unsigned char>(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = static_cast<unsigned char>(value);
+
+  return n;
+}
+
+/** Returns false on a truncated varint **/
+inline bool readVarint(const unsigned char *&in, const unsigned char *end,
+                       uint64_t &value) {
+  value = 0;
+  for (unsigned shift{}; in != end && shift < 64; shift += 7) {
+    unsigned char byte{*in++};
+    value |= uint64_t{byte & 0x7fu} << shift;
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+/** Number of varints following each op **/
+inline int argCount(Op op) {
+  switch (op) {
+  case Op::Free:
+    return 1;
+  case Op::Malloc:
+  case Op::Calloc:
+    return 2;
+  case Op::Realloc:
+  case Op::Aligned:
+    return 3;
+  }
+
+  return -1;
+}
+
+} // namespace trace
+} // namespace memalloc